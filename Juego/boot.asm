@@ -1,3 +1,9 @@
+%ifndef KERNEL_SECTORS
+%define KERNEL_SECTORS 52
+%endif
+SECTORS_PER_TRACK equ 18
+PACK_SECTORS      equ 10   ; Encabezado y hasta 9 niveles (PACK_MAX en kmain.c)
+
 section .boot
 bits 16
 global boot
@@ -5,19 +11,53 @@ boot:
 	mov ax, 0x2401
 	int 0x15
 
+%ifdef MODE13H
+	mov ax, 0x13
+	int 0x10
+%else
 	mov ax, 0x3
 	int 0x10
+%endif
 
 	mov [disk],dl
 
-	mov ah, 0x2    ;read sectors
-	mov al, 24     ;sectors to read
+%ifdef MODE13H
+	; Fuente 8x8 de la ROM (caracteres 0-127) para escribir texto en modo 13h
+	push es
+	mov ax, 0x1130
+	mov bh, 0x03
+	int 0x10
+	mov [font8x8], bp
+	mov [font8x8 + 2], es
+	pop es
+%endif
+
+	; Lee un sector a la vez para no cruzar pistas (disquete de 1.44 MB)
+%ifdef LONG_MODE
+	; En modo largo no se vuelve a modo real, el paquete de niveles se lee ahora
+	mov si, KERNEL_SECTORS + PACK_SECTORS
+%else
+	mov si, KERNEL_SECTORS ;sectors to read
+%endif
 	mov ch, 0      ;cylinder idx
 	mov dh, 0      ;head idx
 	mov cl, 2      ;sector idx
-	mov dl, [disk] ;disk idx
 	mov bx, copy_target;target pointer
+read_sector:
+	mov ax, 0x0201 ;read 1 sector
+	mov dl, [disk] ;disk idx
 	int 0x13
+	add bx, 512
+	inc cl
+	cmp cl, SECTORS_PER_TRACK + 1
+	jne .next
+	mov cl, 1
+	xor dh, 1
+	jnz .next
+	inc ch
+.next:
+	dec si
+	jnz read_sector
 	cli
 	lgdt [gdt_pointer]
 	mov eax, cr0
@@ -46,14 +86,47 @@ gdt_data:
 	db 10010010b
 	db 11001111b
 	db 0x0
+gdt_code16:          ; Segmentos de 16 bits para volver a modo real
+	dw 0xFFFF
+	dw 0x0
+	db 0x0
+	db 10011010b
+	db 00000000b
+	db 0x0
+gdt_data16:
+	dw 0xFFFF
+	dw 0x0
+	db 0x0
+	db 10010010b
+	db 00000000b
+	db 0x0
+%ifdef LONG_MODE
+gdt_code64:          ; Segmento de código de 64 bits (L = 1)
+	dw 0xFFFF
+	dw 0x0
+	db 0x0
+	db 10011010b
+	db 10101111b
+	db 0x0
+%endif
 gdt_end:
 gdt_pointer:
 	dw gdt_end - gdt_start
 	dd gdt_start
 disk:
 	db 0x0
+%ifdef MODE13H
+global font8x8
+font8x8:
+	dd 0x0     ;segmento:offset
+%endif
 CODE_SEG equ gdt_code - gdt_start
 DATA_SEG equ gdt_data - gdt_start
+CODE16_SEG equ gdt_code16 - gdt_start
+DATA16_SEG equ gdt_data16 - gdt_start
+%ifdef LONG_MODE
+CODE64_SEG equ gdt_code64 - gdt_start
+%endif
 
 times 510 - ($-$$) db 0
 dw 0xaa55
@@ -61,14 +134,391 @@ dw 0xaa55
 
 copy_target:
 bits 32
+extern bss_start
+extern bss_end
 boot2:
+	cld
+%ifdef LONG_MODE
+	; El paquete quedó detrás del kernel, donde empieza la .bss
+	mov esi, copy_target + KERNEL_SECTORS * 512
+	mov edi, PACK_COPY
+	mov ecx, PACK_SECTORS * 512 / 4
+	rep movsd
+%endif
+	; La .bss no viene completa del disco, se limpia antes de usarla
+	mov edi, bss_start
+	mov ecx, bss_end
+	sub ecx, edi
+	xor eax, eax
+	rep stosb
+	mov esp, kernel_stack_top
+%ifdef SSE
+	call enable_sse
+%endif
+%ifdef PAGING
+	call setup_paging
+%endif
 	extern kmain
+%ifdef LONG_MODE
+	jmp CODE64_SEG:boot64
+
+bits 64
+boot64:
+	mov ax, DATA_SEG
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+	mov rsp, kernel_stack_top
+	call kmain
+	cli
+	hlt
+
+PACK_COPY equ 0x2000    ; Copia del paquete de niveles hecha en boot2
+
+; bool disk_read(u32 lba, void *dst): en modo largo no se puede volver a modo
+; real para usar la int 0x13, así que solo copia uno de los PACK_SECTORS
+; sectores del paquete que leyó el sector de arranque. Retorna 0 fuera de ellos.
+global disk_read
+disk_read:
+	mov eax, edi
+	sub eax, KERNEL_SECTORS + 1
+	cmp eax, PACK_SECTORS
+	jae .fail
+	shl eax, 9
+	mov rdi, rsi
+	lea rsi, [rax + PACK_COPY]
+	mov ecx, 512 / 8
+	rep movsq
+	mov eax, 1
+	ret
+.fail:
+	xor eax, eax
+	ret
+
+bits 32
+%else
 	call kmain
 	cli
 	hlt
 
-section .bss
-align 4
+BOUNCE   equ 0x7000     ; Sector leído por el BIOS, debajo de 64 KB
+RM_STACK equ 0x7000     ; Pila en modo real, crece hacia abajo
+
+; bool disk_read(u32 lba, void *dst): lee un sector del disco de arranque con
+; la int 0x13, volviendo a modo real solo durante la lectura. Retorna 0 si el
+; BIOS reportó un error, en ese caso no toca dst.
+global disk_read
+disk_read:
+	push ebp
+	mov ebp, esp
+	pushad
+	mov eax, [ebp + 12]
+	mov [rm_dst], eax
+	mov [pm_esp], esp
+	mov eax, cr0
+	mov [pm_cr0], eax
+
+	; LBA -> CHS (2 cabezas, SECTORS_PER_TRACK sectores por pista)
+	mov eax, [ebp + 8]
+	xor edx, edx
+	mov ecx, SECTORS_PER_TRACK
+	div ecx
+	inc dl
+	mov [rm_sector], dl
+	mov dl, al
+	and dl, 1
+	mov [rm_head], dl
+	shr eax, 1
+	mov [rm_cylinder], al
+	jmp CODE16_SEG:.pm16
+
+bits 16
+.pm16:
+	mov ax, DATA16_SEG
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+	mov eax, cr0
+	and eax, 0x7FFFFFFE ; sin paginación ni modo protegido
+	mov cr0, eax
+	jmp 0:.rm
+.rm:
+	xor ax, ax
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+	mov sp, RM_STACK
+	lidt [rm_idt]
+	sti
+	mov ax, 0x0201      ;read 1 sector
+	mov ch, [rm_cylinder]
+	mov cl, [rm_sector]
+	mov dh, [rm_head]
+	mov dl, [disk]
+	mov bx, BOUNCE
+	int 0x13
+	setnc [rm_ok]
+	cli
+	mov eax, [pm_cr0]
+	mov cr0, eax
+	jmp dword CODE_SEG:.pm32
+
+bits 32
+.pm32:
+	mov ax, DATA_SEG
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+	mov esp, [pm_esp]
+	cmp byte [rm_ok], 0
+	je .done
+	mov esi, BOUNCE
+	mov edi, [rm_dst]
+	mov ecx, 512 / 4
+	rep movsd
+.done:
+	popad
+	movzx eax, byte [rm_ok]
+	pop ebp
+	ret
+
+rm_idt:
+	dw 0x3FF            ;IVT del BIOS
+	dd 0x0
+pm_esp:
+	dd 0x0
+pm_cr0:
+	dd 0x0
+rm_dst:
+	dd 0x0
+rm_cylinder:
+	db 0x0
+rm_head:
+	db 0x0
+rm_sector:
+	db 0x0
+rm_ok:
+	db 0x0
+%endif
+
+%ifdef SSE
+; Habilita SSE en el núcleo actual: sin emulación de FPU (EM), con MP, y
+; FXSAVE/instrucciones SSE en CR4 (OSFXSR, OSXMMEXCPT).
+enable_sse:
+	mov eax, cr0
+	and eax, ~(1 << 2)
+	or eax, 1 << 1
+	mov cr0, eax
+	mov eax, cr4
+	or eax, 1 << 9 | 1 << 10
+	mov cr4, eax
+	ret
+%endif
+
+%ifdef PAGING
+PG_PRESENT equ 1 << 0
+PG_WRITE   equ 1 << 1
+PG_PWT     equ 1 << 3  ; Con PA1 = WC selecciona write-combining
+PG_LARGE   equ 1 << 7  ; Página de 4 MB (PSE), 2 MB en modo largo
+PAT_MSR    equ 0x277
+EFER_MSR   equ 0xC0000080
+%ifdef LONG_MODE
+PTE_SIZE   equ 8       ; Entradas de 64 bits (PAE)
+%else
+PTE_SIZE   equ 4
+%endif
+%ifdef MODE13H
+VGA_WINDOW equ 0xA0000 ; Memoria gráfica del modo 13h
+VGA_PAGES  equ 16
+%else
+VGA_WINDOW equ 0xB8000 ; Memoria del modo de texto
+VGA_PAGES  equ 8
+%endif
+
+; Mapea en identidad los primeros 4 MB con páginas de 4 KB y el resto de los
+; 4 GB con páginas de 4 MB (tablas ACPI, APIC local). En modo largo son cuatro
+; niveles: PML4 -> PDPT -> 4 directorios con páginas de 2 MB, salvo los primeros
+; 2 MB que usan page_table con páginas de 4 KB. Si el CPU tiene PAT, la
+; ventana VGA (0xB8000 en texto, 0xA0000 en modo 13h) usa la entrada PA1 =
+; write-combining (WC); el resto de la memoria queda con el tipo de los MTRR.
+setup_paging:
+%ifdef LONG_MODE
+	; La .bss ya está en cero, solo se escribe la mitad baja de cada entrada
+	mov edi, page_table
+	mov eax, PG_PRESENT | PG_WRITE
+	mov ecx, 512
+.fill_pt:
+	mov [edi], eax
+	add edi, PTE_SIZE
+	add eax, 0x1000
+	loop .fill_pt
+
+	mov edi, page_directory
+	mov eax, PG_PRESENT | PG_WRITE | PG_LARGE
+	mov ecx, 4 * 512
+.fill_pd:
+	mov [edi], eax
+	add edi, PTE_SIZE
+	add eax, 0x200000
+	loop .fill_pd
+	mov eax, page_table
+	or eax, PG_PRESENT | PG_WRITE
+	mov [page_directory], eax
+
+	mov edi, page_pdpt
+	mov eax, page_directory
+	or eax, PG_PRESENT | PG_WRITE
+	mov ecx, 4
+.fill_pdpt:
+	mov [edi], eax
+	add edi, PTE_SIZE
+	add eax, 0x1000
+	loop .fill_pdpt
+	mov eax, page_pdpt
+	or eax, PG_PRESENT | PG_WRITE
+	mov [page_pml4], eax
+%else
+	mov edi, page_table
+	mov eax, PG_PRESENT | PG_WRITE
+	mov ecx, 1024
+.fill_pt:
+	stosd
+	add eax, 0x1000
+	loop .fill_pt
+
+	mov edi, page_directory
+	mov eax, PG_PRESENT | PG_WRITE | PG_LARGE
+	mov ecx, 1024
+.fill_pd:
+	stosd
+	add eax, 0x400000
+	loop .fill_pd
+	mov eax, page_table
+	or eax, PG_PRESENT | PG_WRITE
+	mov [page_directory], eax
+%endif
+
+	mov eax, 1
+	cpuid
+	test edx, 1 << 16        ;CPUID.01h:EDX.PAT
+	jz enable_paging
+	mov edi, page_table + (VGA_WINDOW >> 12) * PTE_SIZE
+	mov ecx, VGA_PAGES
+.vga_wc:
+	or dword [edi], PG_PWT
+	add edi, PTE_SIZE
+	loop .vga_wc
+	mov byte [pat_enabled], 1
+
+; Activa las tablas de setup_paging en el núcleo actual. Cada núcleo tiene su
+; propio PAT, así que los AP también pasan por aquí.
+enable_paging:
+	cmp byte [pat_enabled], 0
+	je .no_pat
+	mov ecx, PAT_MSR
+	rdmsr
+	and eax, 0xFFFF00FF
+	or eax, 0x00000100       ;PA1 = 01h (WC)
+	wrmsr
+	wbinvd
+.no_pat:
+%ifdef LONG_MODE
+	mov eax, cr4
+	or eax, 1 << 5           ;PAE
+	mov cr4, eax
+	mov eax, page_pml4
+	mov cr3, eax
+	mov ecx, EFER_MSR
+	rdmsr
+	or eax, 1 << 8           ;LME, el modo largo se activa junto con CR0.PG
+	wrmsr
+%else
+	mov eax, cr4
+	or eax, 1 << 4           ;PSE
+	mov cr4, eax
+	mov eax, page_directory
+	mov cr3, eax
+%endif
+	mov eax, cr0
+	or eax, 0x80000000
+	mov cr0, eax
+	ret
+%endif
+
+%ifdef SMP
+; El AP arranca en modo real en CS:IP = 0x0100:0000, donde smp_init() copia el
+; código entre ap_trampoline y ap_trampoline_end. Solo usa direcciones absolutas.
+global ap_trampoline
+global ap_trampoline_end
+bits 16
+ap_trampoline:
+	cli
+	xor ax, ax
+	mov ds, ax
+	lgdt [gdt_pointer]
+	mov eax, cr0
+	or eax,0x1
+	mov cr0, eax
+	jmp dword CODE_SEG:ap_boot
+ap_trampoline_end:
+
+bits 32
+ap_boot:
+	mov ax, DATA_SEG
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+	mov esp, ap_stack_top
+%ifdef SSE
+	call enable_sse
+%endif
+%ifdef PAGING
+	call enable_paging
+%endif
+	extern ap_main
+	call ap_main
+.halt:
+	cli
+	hlt
+	jmp .halt
+%endif
+
+%ifdef PAGING
+section .data
+global pat_enabled
+pat_enabled:
+	db 0
+%endif
+
+section .bss align=4096
+%ifdef PAGING
+global page_table
+%ifdef LONG_MODE
+page_pml4:
+	resq 512
+page_pdpt:
+	resq 512
+page_directory:
+	resq 4 * 512
+%else
+page_directory:
+	resd 1024
+%endif
+page_table:
+	resd 1024
+%endif
+alignb 4
 kernel_stack_bottom: equ $
 	resb 16384 ; 16 KB
 kernel_stack_top:
+%ifdef SMP
+ap_stack_bottom:
+	resb 4096
+ap_stack_top:
+%endif
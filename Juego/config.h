@@ -1,15 +1,38 @@
 /* Player specific values */
 #define LIFES (3)             // 3 lives before game over
-#define BULLET_SPEED (40)    // Velocidad bala del jugador
-
-/* Enemy specific values */
-#define ENEMY_1_SPEED (400)  // Interval in ms to apply gravity for level 1 enemy
-#define ENEMY_2_SPEED (60)  // Interval in ms to apply gravity for level 2 enemy
-#define ENEMY_3_SPEED (60)  // Interval in ms to apply gravity for level 3 enemy
-#define ENEMY_4_SPEED (400)  // Interval in ms to apply gravity for level 4 enemy
-
-/* Other */
-#define WALL_1_SPEED (25)     // Intervalo en el que se aplica gravedad a la pared del nivel 1
-#define WALL_2_SPEED (45)     // Intervalo en el que se aplica gravedad a la pared del nivel 2
-#define WALL_3_SPEED (45)     // Intervalo en el que se aplica gravedad a la pared del nivel 3
-#define WALL_4_SPEED (25)     // Intervalo en el que se aplica gravedad a la pared del nivel 4
+
+/* La velocidad y forma de cada nivel están en levels.txt */
+
+/* Simulación de paso fijo */
+#define SIM_STEP_MS (5)         // Milisegundos simulados por paso
+#define SIM_MAX_STEPS (8)       // Pasos que se recuperan como máximo en una iteración
+
+/* Presupuesto por iteración del loop de juego */
+#define FRAME_BUDGET_US (4000)  // Microsegundos antes de contar la iteración como atrasada
+#define GOV_MISSES (3)          // Atrasos seguidos para degradar un nivel
+#define GOV_CALM (120)          // Iteraciones seguidas a tiempo para recuperar un nivel
+#define GOV_HUD_EVERY (8)       // Con el HUD degradado se refresca uno de cada N cuadros
+#define GOV_PRESENT_EVERY (4)   // En el último nivel se presenta uno de cada N cuadros
+
+/* Instantáneas para reiniciar y retroceder (tecla R) */
+#define SNAP_EVERY (50)       // Ticks de pared entre instantáneas
+#define SNAP_KEY   (8)        // Cada cuántas instantáneas se guarda una completa
+#define SNAP_LOG   (32768)    // Bytes del anillo de instantáneas
+
+/* Latencia de entrada (tecla L durante el juego) */
+#define LAT_EVENTS (128)      // Mediciones que guarda el anillo
+
+/* Benchmark (make bench) */
+#define BENCH_SEED (12345)    // Semilla fija para que cada corrida sea igual
+#define BENCH_MS   (20000)    // Duración del escenario desde que empieza el nivel
+#define BENCH_KEY_MS (150)    // Intervalo en ms entre teclas del escenario
+#define BENCH_SWEEP (8)       // Pasos del jugador hacia cada lado
+
+/* Nivel de estrés oculto (tecla H en la selección de nivel) */
+#define STRESS_ENEMIES (30)       // % de la fila de arriba que se llena de enemigos en cada tick de pared
+#define STRESS_BULLETS (30)       // % de la fila del jugador que se llena de balas en cada tick de balas
+#define STRESS_ENEMY_SPEED (60)   // Intervalo en ms para aplicar gravedad a los enemigos
+#define STRESS_BULLET_SPEED (40)  // Intervalo en ms para mover las balas
+#define STRESS_WALL_SPEED (25)    // Intervalo en ms para mover la pared
+#define STRESS_WALL (77)          // Ancho entre paredes, 77 abarca toda la pantalla
+#define STRESS_BUCKET (100)       // Entidades por fila del reporte
@@ -8,6 +8,7 @@ typedef unsigned int       u32;
 typedef signed   int       s32;
 typedef unsigned long long u64;
 typedef signed   long long s64;
+typedef unsigned long      uptr;  // Del tamaño de un puntero, 32 o 64 bits
 
 typedef enum bool {
     false,
@@ -36,7 +37,8 @@ enum timer {
 
 /* Entradas de teclado */
 #define KEY_D     (0x20)
-#define KEY_H     (0x23)
+#define KEY_H     (0x23)  // Nivel de estrés oculto
+#define KEY_L     (0x26)  // Reporte de latencia de entrada
 #define KEY_P     (0x19)
 #define KEY_R     (0x13)
 #define KEY_S     (0x1F)
@@ -55,6 +57,16 @@ enum timer {
 
 u16* const vga = (u16*) 0xb8000;
 
+/* Celdas donde escribe el juego. Con SMP es un buffer en RAM que el segundo
+ * núcleo copia a la VGA, así la simulación no paga el costo de escribir en ella.
+ * En modo 13h el mismo buffer se pinta como píxeles en show().*/
+#if defined(SMP) || defined(MODE13H)
+u16 backbuffer[ROWS * COLS];
+u16* const screen = backbuffer;
+#else
+u16* const screen = (u16*) 0xb8000;
+#endif
+
 u32 last_enemy = 0, life;
 u32 score = 0, speed_e = 0, speed_b = 0, speed_w = 0;
 u32 swapColor = 0, wallStart = 0, wallInterval = 0;
@@ -64,11 +76,12 @@ char option;
 
 //DEBUG variables
 u32 playerX, playerY, disparos, enemigo, pared;
+u32 live_enemies = 0, live_bullets = 0;  // Vistos en la última pasada de move_*
 
 bool debug;
 bool paused = false, game_over = false;
 
-u64 timers[TIMER__LENGTH] = {0};
+u32 timers[TIMER__LENGTH] = {0};  // Próximo disparo, en ms de tiempo simulado
 u64 tpms;     // Ticks por milisegundo
 
 /*==============================================================================
@@ -77,7 +90,7 @@ u64 tpms;     // Ticks por milisegundo
 /* Escribe un carácter*/
 void putc(u8 x, u8 y, enum color fg, enum color bg, char c){
     u16 z = (bg << 12) | (fg << 8) | c;
-    vga[y * COLS + x] = z;
+    screen[y * COLS + x] = z;
 }
 
 /* Escribe un string*/
@@ -88,7 +101,7 @@ void puts(u8 x, u8 y, enum color fg, enum color bg, const char *s){
 
 /* Retorna el carácter en la posición xXy*/
 char getc(u8 x, u8 y){
-  return vga[y * COLS + x];
+  return screen[y * COLS + x];
 }
 
 /* Pinta la pantalla de un color*/
@@ -99,6 +112,79 @@ void clear(enum color bg){
             putc(x, y, bg, bg, ' ');
 }
 
+/* Copia una pantalla completa de celdas, dos celdas por escritura.*/
+void copy_cells(u16 *dst, const u16 *src){
+    u32 *d = (u32*) dst;
+    const u32 *s = (const u32*) src;
+    u32 i;
+    for (i = 0; i < ROWS * COLS / 2; i++)
+        d[i] = s[i];
+}
+
+/* Llena n celdas seguidas con la misma, dos celdas por escritura.*/
+void fill_cells(u16 *dst, u32 n, u16 cell){
+    u32 w = cell | (u32) cell << 16;
+    if (n && ((uptr) dst & 2)) *dst++ = cell, n--;
+    for (; n >= 2; n -= 2, dst += 2)
+        *(u32*) dst = w;
+    if (n) *dst = cell;
+}
+
+/* Operaciones de las plantillas de pantalla, ver mkscreens.py.*/
+#define TPL_SKIP      (0)
+#define TPL_LONG_SKIP (1)
+#define TPL_RUN       (2)
+#define TPL_TEXT      (3)
+
+/* Expande una plantilla de mkscreens.py en la pantalla, sin tocar las celdas
+ * que la plantilla salta.*/
+void blit_template(const u8 *t){
+    u16 *p = screen, cell;
+    u8 op, n;
+    while ((op = *t++)) {
+        n = op & 0x3F;
+        switch (op >> 6) {
+            case TPL_SKIP:
+                p += n;
+                break;
+            case TPL_LONG_SKIP:
+                p += n * 64;
+                break;
+            case TPL_RUN:
+                fill_cells(p, n, t[0] << 8 | t[1]);
+                p += n, t += 2;
+                break;
+            case TPL_TEXT:
+                cell = *t++ << 8;
+                while (n--) *p++ = cell | *t++;
+                break;
+        }
+    }
+}
+
+/* Copia n bytes de memoria.*/
+void copy_bytes(void *dst, const void *src, u32 n){
+    u8 *d = dst;
+    const u8 *s = src;
+    while (n--) *d++ = *s++;
+}
+
+/* Retorna true si dos pantallas tienen las mismas celdas.*/
+bool same_cells(const u16 *a, const u16 *b){
+    const u32 *x = (const u32*) a, *y = (const u32*) b;
+    u32 i;
+    for (i = 0; i < ROWS * COLS / 2; i++)
+        if (x[i] != y[i]) return false;
+    return true;
+}
+
+/* Compara n bytes de memoria con una firma.*/
+bool signature(const u8 *p, const char *sig, u32 n){
+    while (n--)
+        if (*p++ != (u8) *sig++) return false;
+    return true;
+}
+
 char* itoa(u32 n, u8 r, u8 w){
   static const char d[16] = "0123456789ABCDEF";
   static char s[34];
@@ -118,25 +204,40 @@ char* itoa(u32 n, u8 r, u8 w){
 /* Recibe un valor de 8 bits de un puerto de I/O*/
 static inline u8 inb(u16 p){
     u8 r;
-    asm("inb %1, %0" : "=a" (r) : "dN" (p));
+    asm volatile("inb %1, %0" : "=a" (r) : "dN" (p) : "memory");
     return r;
 }
 
 /* Envía un valor de 8 bits a un puerto de I/O*/
 static inline void outb(u16 p, u8 d){
-    asm("outb %1, %0" : : "dN" (p), "a" (d));
+    asm volatile("outb %1, %0" : : "dN" (p), "a" (d) : "memory");
 }
 
 /*==============================================================================
                               FUNCIONES DE TIEMPO
 ==============================================================================*/
-/* ReaD Time-Stamp Counter, retorna el número ticks del CPU desde que se inicio*/
+/* ReaD Time-Stamp Counter, retorna el número ticks del CPU desde que se inicio.
+ * Es volatile para que con -O2 no se junten ni se muevan dos lecturas.*/
 static inline u64 rdtsc(void){
   u32 a, b;
-  asm("rdtsc" : "=a" (a), "=d" (b));
+  asm volatile("rdtsc" : "=a" (a), "=d" (b));
   return ((u64) a) | (((u64) b) << 32);
 }
 
+/* Divide un u64 entre un u32 con dos divl, sin depender de libgcc. En modo
+ * largo la división de 64 bits es una sola instrucción.*/
+u64 div64(u64 n, u32 d){
+#ifdef LONG_MODE
+  return n / d;
+#else
+  u32 hi = (u32) (n >> 32), lo = (u32) n, q, r;
+  q = hi / d;
+  r = hi % d;
+  asm("divl %4" : "=a" (lo), "=d" (r) : "a" (lo), "d" (r), "rm" (d));
+  return ((u64) q << 32) | lo;
+#endif
+}
+
 /* Real-Time-Clock-Second, retorna el segundo actual en el RTC.*/
 u8 rtcs(void){
   u8 last = 0, sec;
@@ -166,49 +267,1130 @@ void tps(void){
   }
 }
 
+/* La simulación avanza en pasos fijos de SIM_STEP_MS milisegundos. Cada
+ * iteración acumula los ciclos que pasaron y simula los pasos completos que
+ * caben, a lo más SIM_MAX_STEPS; el atraso que sobra se descarta para no
+ * quedar persiguiendo al reloj. Los timers se miden en tiempo simulado.*/
+u32 sim_ms = 0;                       // Tiempo simulado
+u64 sim_last = 0, sim_acc = 0;        // Última lectura del TSC y ciclos sin simular
+u32 sim_steps = 0, sim_dropped = 0;   // Pasos simulados y descartados
+
+/* Vacía el acumulador, ej. al volver al juego desde un menú.*/
+void sim_reset(void){
+  sim_last = rdtsc();
+  sim_acc = 0;
+}
+
+/* Retorna cuántos pasos simular en esta iteración.*/
+u32 sim_advance(void){
+  u64 now = rdtsc();
+  u32 step = (u32) (tpms * SIM_STEP_MS), n = 0;
+  sim_acc += now - sim_last;
+  sim_last = now;
+  if(!step) return 0;
+  while(sim_acc >= step && n < SIM_MAX_STEPS){
+    sim_acc -= step;
+    n++;
+  }
+  if(sim_acc >= step){
+    u32 late = (u32) div64(sim_acc, step);
+    sim_dropped += late;
+    sim_acc -= (u64) late * step;
+  }
+  sim_steps += n;
+  return n;
+}
+
 /* Función que revisa si se han pasado ms milisegundos desde la última vez que
- * este timer devolvió true. En el ciclo principal devuelve true una vez ms
- * milisegundos.*/
+ * este timer devolvió true. El próximo disparo se cuenta desde el anterior y
+ * no desde ahora, así el atraso de un paso no se acumula; si el timer quedó
+ * más de un periodo atrás vuelve a contar desde ahora.*/
 bool interval(enum timer timer, u32 ms){
-  u64 tf = rdtsc();   //ticks desde el boot
-  if (tf - timers[timer] >= tpms * ms) {
-    timers[timer] = tf;
-    return true;
-  }
-  else return false;
+  if ((s32) (sim_ms - timers[timer]) < 0) return false;
+  timers[timer] += ms;
+  if ((s32) (sim_ms - timers[timer]) >= 0) timers[timer] = sim_ms + ms;
+  return true;
 }
 
 /* Función que revisa si han pasado ms milisegundos desde la primera llamada de
  * este timer, y lo resetea.*/
 bool wait(enum timer timer, u32 ms){
   if(timers[timer]) {
-    if(rdtsc() - timers[timer] >= tpms * ms) {
+    if((s32) (sim_ms - timers[timer]) >= 0) {
       timers[timer] = 0;
       return true;
     }
     else return false;
   }
   else {
-    timers[timer] = rdtsc();
+    timers[timer] = sim_ms + ms;
     return false;
   }
 }
 
-/*Un generador de randoms, basado en el número de ticks desde el inicio*/
+/* Generador de randoms xorshift32. La semilla sale del número de ticks desde
+ * el inicio, o de BENCH_SEED para que el benchmark sea reproducible.*/
+u32 seed = 1;
+
+void srand(u32 s){
+  seed = s ? s : 1;
+}
+
 u32 rand(u32 range){
-  return (u32) rdtsc() % range;
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed % range;
+}
+
+/*==============================================================================
+                              PRESUPUESTO DE CUADRO
+==============================================================================*/
+/* Cada iteración del loop de juego tiene FRAME_BUDGET_US microsegundos. Tras
+ * GOV_MISSES iteraciones seguidas pasadas del presupuesto el gobernador sube
+ * un nivel y abarata trabajo que no es simulación, en este orden; tras
+ * GOV_CALM iteraciones seguidas a tiempo baja uno.*/
+enum gov {
+  GOV_NORMAL,
+  GOV_FLASH,    // La pared deja de parpadear
+  GOV_HUD,      // HUD y debug solo cada GOV_HUD_EVERY cuadros
+  GOV_WALL,     // La fila de la pared se llena de a dos celdas
+  GOV_PRESENT,  // Se presenta solo uno de cada GOV_PRESENT_EVERY cuadros
+  GOV__LENGTH
+};
+
+const char *gov_names[GOV__LENGTH] = {"normal", "flash", "hud", "wall", "present"};
+enum gov gov = GOV_NORMAL;
+u32 gov_misses = 0, gov_calm = 0;      // Rachas actuales
+u32 gov_frames[GOV__LENGTH];           // Iteraciones en cada nivel
+u32 gov_late = 0, gov_ups = 0, gov_downs = 0, gov_count = 0;
+u64 gov_over = 0;                      // Ciclos sumados por encima del presupuesto
+
+/* Registra una iteración de cycles ciclos y ajusta el nivel.*/
+void gov_frame(u64 cycles){
+  u64 budget = div64(tpms * FRAME_BUDGET_US, 1000);
+  gov_frames[gov]++;
+  gov_count++;
+  if(cycles > budget){
+    gov_late++;
+    gov_over += cycles - budget;
+    gov_calm = 0;
+    if(++gov_misses >= GOV_MISSES && gov < GOV__LENGTH - 1){
+      gov++;
+      gov_ups++;
+      gov_misses = 0;
+    }
+  }
+  else {
+    gov_misses = 0;
+    if(++gov_calm >= GOV_CALM && gov > GOV_NORMAL){
+      gov--;
+      gov_downs++;
+      gov_calm = 0;
+    }
+  }
+}
+
+/* Retorna true si en esta iteración se refresca el HUD.*/
+bool gov_hud(void){
+  return gov < GOV_HUD || gov_count % GOV_HUD_EVERY == 0;
+}
+
+/* Retorna true si en esta iteración se presenta el cuadro. Lo que no se
+ * presenta sigue en la pantalla y sale en el próximo cuadro presentado.*/
+bool gov_present(void){
+  return gov < GOV_PRESENT || gov_count % GOV_PRESENT_EVERY == 0;
+}
+
+/* Un nivel nuevo empieza sin degradar; las estadísticas se conservan.*/
+void gov_reset(void){
+  gov = GOV_NORMAL;
+  gov_misses = gov_calm = 0;
 }
 
+/*==============================================================================
+                              MODO GRÁFICO 13h
+==============================================================================*/
+#ifdef MODE13H
+/* Cada celda de texto ocupa 4x8 píxeles de la pantalla de 320x200 a 256 colores;
+ * una fila de una celda cabe exacta en una palabra de 32 bits. Los colores
+ * 0-15 de la paleta por defecto son los mismos del modo de texto.*/
+#define GFX_W     (320)
+#define GFX_H     (200)
+#define CELL_W    (GFX_W / COLS)
+#define CELL_H    (8)
+#define SPRITE_H  (8)
+
+u8* const gfx = (u8*) 0xA0000;
+u8 pixels[GFX_W * GFX_H];     // Cuadro fuera de pantalla
+
+extern u16 font8x8[2];         // Segmento:offset de la fuente de la ROM (boot.asm)
+u8 glyphs[128][CELL_H];        // Fuente reducida a 4 píxeles de ancho
+u32 expand4[16];               // 4 bits -> máscara de 4 bytes
+
+/* Sprites de 8x8 centrados en su celda, un byte por fila (bit 7 a la izquierda).*/
+struct sprite {
+  char c;
+  u8 rows[SPRITE_H];
+};
+const struct sprite sprites[] = {
+  {'@', {0x3C, 0x7E, 0xDB, 0xFF, 0xFF, 0xBD, 0xC3, 0x7E}},
+  {'X', {0xC3, 0xE7, 0x7E, 0x3C, 0x3C, 0x7E, 0xE7, 0xC3}},
+  {'x', {0x00, 0x42, 0x66, 0x3C, 0x3C, 0x66, 0x42, 0x00}},
+  {'*', {0x00, 0x24, 0x18, 0x7E, 0x18, 0x24, 0x00, 0x00}},
+  {'.', {0x00, 0x00, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00}},
+  {'o', {0x00, 0x18, 0x3C, 0x3C, 0x18, 0x00, 0x00, 0x00}},
+};
+#define SPRITES (sizeof(sprites) / sizeof(sprites[0]))
+
+/* Contadores de throughput del renderizador.*/
+u32 gfx_frames = 0, gfx_sprites = 0, gfx_glyphs = 0;
+u64 gfx_bytes = 0, gfx_cycles = 0;
+u32 gfx_last = 0;              // Ciclos del último cuadro
+
+#ifdef __SSE2__
+typedef u32 v4u32 __attribute__((vector_size(16)));
+#endif
+
+/* Prepara las máscaras y reduce la fuente 8x8 de la ROM a 4x8, juntando cada
+ * par de columnas.*/
+void gfx_init(void){
+  const u8 *rom = (const u8*) (uptr) (((u32) font8x8[1] << 4) + font8x8[0]);
+  u32 c, r, i;
+  for(i = 0; i < 16; i++)
+    expand4[i] = (i & 8 ? 0x000000FF : 0) | (i & 4 ? 0x0000FF00 : 0) |
+                 (i & 2 ? 0x00FF0000 : 0) | (i & 1 ? 0xFF000000 : 0);
+  for(c = 0; c < 128; c++)
+    for(r = 0; r < CELL_H; r++){
+      u8 b = rom[c * 8 + r], g = 0;
+      for(i = 0; i < 4; i++)
+        if(b & (0xC0 >> (i * 2))) g |= 8 >> i;
+      glyphs[c][r] = g;
+    }
+}
+
+/* Llena n bytes con un color: palabras de 32 bits y, con SSE2, de 128 bits
+ * alineadas.*/
+void fill_span(u8 *dst, u32 n, u8 color){
+  u32 w = color * 0x01010101u;
+  gfx_bytes += n;
+  for(; n && ((uptr) dst & 3); n--) *dst++ = color;
+#ifdef __SSE2__
+  for(; n >= 4 && ((uptr) dst & 15); n -= 4, dst += 4) *(u32*) dst = w;
+  {
+    v4u32 v = {w, w, w, w};
+    for(; n >= 16; n -= 16, dst += 16) *(v4u32*) dst = v;
+  }
+#endif
+  for(; n >= 4; n -= 4, dst += 4) *(u32*) dst = w;
+  for(; n; n--) *dst++ = color;
+}
+
+/* Copia n bytes alineados a 16 (el cuadro completo hacia la VGA).*/
+void copy_span(u8 *dst, const u8 *src, u32 n){
+#ifdef __SSE2__
+  for(; n >= 16; n -= 16, dst += 16, src += 16)
+    *(v4u32*) dst = *(const v4u32*) src;
+#endif
+  for(; n >= 4; n -= 4, dst += 4, src += 4)
+    *(u32*) dst = *(const u32*) src;
+}
+
+/* Escribe en una palabra los bytes de color que indica la máscara.*/
+static inline void put_word(u32 *dst, u32 mask, u32 color){
+  *dst = (*dst & ~mask) | (color & mask);
+}
+
+/* Dibuja un sprite de un color en (x, y), recortado a la pantalla. La fila se
+ * desplaza (x & 3) bytes y se escribe en las hasta 3 palabras que toca; como
+ * los bordes de la pantalla caen en palabras, basta saltar las de afuera.*/
+void blit(const struct sprite *sp, s32 x, s32 y, u8 color){
+  u32 w = color * 0x01010101u, shift = (x & 3) * 8, r, k;
+  s32 wx = (x - (x & 3)) / 4;
+  gfx_sprites++;
+  for(r = 0; r < SPRITE_H; r++){
+    s32 py = y + r;
+    u8 b = sp->rows[r];
+    u64 m;
+    u32 words[3], *row;
+    if(py < 0 || py >= GFX_H || !b) continue;
+    m = (u64) expand4[b >> 4] | ((u64) expand4[b & 15] << 32);
+    words[0] = (u32) (m << shift);
+    words[1] = (u32) ((m << shift) >> 32);
+    words[2] = shift ? (u32) (m >> (64 - shift)) : 0;
+    row = (u32*) (pixels + py * GFX_W);
+    for(k = 0; k < 3; k++)
+      if(words[k] && wx + (s32) k >= 0 && wx + (s32) k < GFX_W / 4)
+        put_word(row + wx + k, words[k], w);
+  }
+}
+
+const struct sprite* find_sprite(char c){
+  u32 i;
+  for(i = 0; i < SPRITES; i++)
+    if(sprites[i].c == c) return &sprites[i];
+  return 0;
+}
+
+/* Pinta una pantalla de celdas en el cuadro fuera de pantalla: primero los
+ * fondos por tramos de celdas del mismo color, luego las letras de la fuente
+ * y al final los sprites, que pueden salirse de su celda.*/
+void render(const u16 *cells){
+  u32 cx, cy, r;
+  for(cy = 0; cy < ROWS; cy++){
+    const u16 *row = cells + cy * COLS;
+    for(cx = 0; cx < COLS; ){
+      u8 bg = row[cx] >> 12;
+      u32 n = 1;
+      while(cx + n < COLS && (row[cx + n] >> 12) == bg) n++;
+      for(r = 0; r < CELL_H; r++)
+        fill_span(pixels + (cy * CELL_H + r) * GFX_W + cx * CELL_W, n * CELL_W, bg);
+      cx += n;
+    }
+    for(cx = 0; cx < COLS; cx++){
+      u16 cell = row[cx];
+      u8 c = cell & 0xFF, fg = (cell >> 8) & 0xF;
+      u32 w = fg * 0x01010101u;
+      if(c == ' ' || c >= 128 || fg == cell >> 12 || find_sprite(c)) continue;
+      gfx_glyphs++;
+      for(r = 0; r < CELL_H; r++)
+        put_word((u32*) (pixels + (cy * CELL_H + r) * GFX_W) + cx, expand4[glyphs[c][r]], w);
+    }
+  }
+  for(cy = 0; cy < ROWS; cy++)
+    for(cx = 0; cx < COLS; cx++){
+      u16 cell = cells[cy * COLS + cx];
+      const struct sprite *sp = find_sprite(cell & 0xFF);
+      if(sp) blit(sp, cx * CELL_W - 2, cy * CELL_H, (cell >> 8) & 0xF);
+    }
+}
+
+/* Muestra una pantalla de celdas: la pinta fuera de pantalla y copia el cuadro
+ * a la memoria VGA.*/
+void show(const u16 *cells){
+  u64 t = rdtsc();
+  render(cells);
+  copy_span(gfx, pixels, GFX_W * GFX_H);
+  gfx_last = (u32) (rdtsc() - t);
+  gfx_cycles += gfx_last;
+  gfx_frames++;
+}
+
+#else
+/* Muestra una pantalla de celdas en la memoria de texto.*/
+void show(const u16 *cells){
+  if(cells != vga) copy_cells(vga, cells);
+}
+#endif
+
+#ifdef PAGING
+/*==============================================================================
+                              PAGINACIÓN
+==============================================================================*/
+#define PG_PWT    (1 << 3)         // Con el PAT de boot.asm selecciona PA1 = WC
+#ifdef MODE13H
+#define VGA_PAGE  (0xA0000 >> 12)  // Primera página de la memoria gráfica
+#define VGA_PAGES (16)             // 0xA0000 - 0xAFFFF
+#else
+#define VGA_PAGE  (0xB8000 >> 12)  // Primera página de la ventana de texto
+#define VGA_PAGES (8)              // 0xB8000 - 0xBFFFF
+#endif
+#define BENCH_CLEARS (64)          // clear() por medición
+
+#ifdef LONG_MODE
+typedef u64 pte_t;
+#else
+typedef u32 pte_t;
+#endif
+
+extern pte_t page_table[];    // Identidad de los primeros 4 MB (2 MB en modo largo), ver boot.asm
+extern u8 pat_enabled;        // 1 si el CPU tiene PAT y PA1 es write-combining
+
+/* Cambia la ventana VGA entre write-combining y el tipo por defecto (el de los
+ * MTRR, UC en la región VGA), igual que con la paginación apagada.*/
+void vga_wc(bool on){
+  u32 i;
+  for(i = 0; i < VGA_PAGES; i++){
+    if(on) page_table[VGA_PAGE + i] |= PG_PWT;
+    else   page_table[VGA_PAGE + i] &= ~PG_PWT;
+    asm volatile("invlpg (%0)" : : "r" ((uptr) (VGA_PAGE + i) << 12) : "memory");
+  }
+  asm volatile("wbinvd" : : : "memory");
+}
+
+/* Un clear() que llega hasta la memoria VGA.*/
+void bench_clear(void){
+  clear(BLACK);
+  show(screen);
+}
+
+/* Ciclos promedio de un clear() completo, sin y con write-combining. El sfence
+ * vacía los buffers WC para que la medición incluya las escrituras pendientes.*/
+void bench_wc(u32 *uc, u32 *wc){
+  u64 t;
+  u32 i;
+
+  vga_wc(false);
+  t = rdtsc();
+  for(i = 0; i < BENCH_CLEARS; i++) bench_clear();
+  *uc = (u32) ((rdtsc() - t) / BENCH_CLEARS);
+
+  vga_wc(true);
+  t = rdtsc();
+  for(i = 0; i < BENCH_CLEARS; i++) bench_clear();
+  asm volatile("sfence" : : : "memory");
+  *wc = (u32) ((rdtsc() - t) / BENCH_CLEARS);
+}
+
+#endif
+#ifdef SMP
+/*==============================================================================
+                              MULTIPROCESADOR
+==============================================================================*/
+#define LAPIC_ID      (0x020)
+#define LAPIC_ICR_LO  (0x300)
+#define LAPIC_ICR_HI  (0x310)
+#define ICR_PENDING   (1 << 12)
+#define ICR_INIT      (0x4500)  // INIT, assert
+#define ICR_STARTUP   (0x4600)  // Startup IPI, el vector es la página de inicio
+#define AP_TRAMPOLINE (0x1000)  // El AP arranca en modo real en esta dirección
+#define MAX_CPUS      (16)
+#define FRAME_QUEUE   (4)       // Cuadros en la cola entre los núcleos
+
+/* Cola de un productor (simulación, BSP) y un consumidor (pintado, AP). Cada
+ * índice lo escribe un solo núcleo y x86 no reordena escrituras entre sí, así
+ * que basta una barrera del compilador antes de publicar un índice.*/
+struct frame {
+  u16 cells[ROWS * COLS];
+};
+struct frame frames[FRAME_QUEUE];
+volatile u32 frame_head = 0, frame_tail = 0;
+volatile bool ap_running = false;
+volatile u32 frame_shown_seq = 0;   // Número (desde 1) del último cuadro en la VGA, 0 mientras cambia el TSC
+volatile u64 frame_shown_tsc = 0;   // TSC al terminar de mostrarlo
+volatile u32 frames_presented = 0;  // Lo escribe el AP
+u32 frames_dropped = 0;             // Cola llena al publicar
+
+u32 lapic = 0xFEE00000;
+u8 cpus[MAX_CPUS], ncpus = 0;
+
+extern u8 ap_trampoline[], ap_trampoline_end[];  // Ver boot.asm
+
+#define barrier() asm volatile("" : : : "memory")
+
+static inline u32 lapic_read(u32 reg){
+  return *(volatile u32*) (uptr) (lapic + reg);
+}
+
+static inline void lapic_write(u32 reg, u32 v){
+  *(volatile u32*) (uptr) (lapic + reg) = v;
+}
+
+/* Busca una firma alineada a 16 bytes cuya estructura de len bytes sume 0.*/
+u8* find_table(u32 from, u32 to, const char *sig, u32 n, u32 len){
+  for(; from < to; from += 16){
+    u8 *p = (u8*) (uptr) from, sum = 0;
+    u32 i;
+    if(!signature(p, sig, n)) continue;
+    for(i = 0; i < len; i++) sum += p[i];
+    if(sum == 0) return p;
+  }
+  return 0;
+}
+
+/* Segmento del EBDA en el área de datos del BIOS.*/
+u16* volatile const bda_ebda = (u16*) 0x40E;
+
+/* Busca en el primer KB del EBDA y luego en el área del BIOS.*/
+u8* find_bios_table(const char *sig, u32 n, u32 len){
+  u32 ebda = *bda_ebda << 4;
+  u8 *p = ebda ? find_table(ebda, ebda + 1024, sig, n, len) : 0;
+  return p ? p : find_table(0xE0000, 0x100000, sig, n, len);
+}
+
+/* Agrega los procesadores habilitados de la MADT de ACPI.*/
+bool acpi_cpus(void){
+  u8 *rsdp = find_bios_table("RSD PTR ", 8, 20);
+  u32 *rsdt, i;
+  if(!rsdp) return false;
+  rsdt = (u32*) (uptr) *(u32*) (rsdp + 16);
+  for(i = 0; i < (rsdt[1] - 36) / 4; i++){
+    u8 *madt = (u8*) (uptr) rsdt[9 + i], *p, *end;
+    if(!signature(madt, "APIC", 4)) continue;
+    lapic = *(u32*) (madt + 36);
+    end = madt + *(u32*) (madt + 4);
+    for(p = madt + 44; p < end && ncpus < MAX_CPUS; p += p[1])
+      if(p[0] == 0 && (*(u32*) (p + 4) & 1)) cpus[ncpus++] = p[3];
+    return ncpus > 0;
+  }
+  return false;
+}
+
+/* Agrega los procesadores habilitados de la tabla MP de Intel.*/
+bool mp_cpus(void){
+  u8 *mp = find_bios_table("_MP_", 4, 16), *cfg, *p;
+  u32 i;
+  if(!mp || !(cfg = (u8*) (uptr) *(u32*) (mp + 4))) return false;
+  lapic = *(u32*) (cfg + 36);
+  for(i = 0, p = cfg + 44; i < *(u16*) (cfg + 34) && ncpus < MAX_CPUS; i++){
+    if(p[0] == 0){
+      if(p[3] & 1) cpus[ncpus++] = p[1];
+      p += 20;
+    }
+    else p += 8;
+  }
+  return ncpus > 0;
+}
+
+/* Espera ms milisegundos, requiere tpms calibrado.*/
+void delay(u32 ms){
+  u64 t = rdtsc();
+  while(rdtsc() - t < tpms * ms);
+}
+
+void send_ipi(u8 id, u32 icr){
+  lapic_write(LAPIC_ICR_HI, (u32) id << 24);
+  lapic_write(LAPIC_ICR_LO, icr);
+  while(lapic_read(LAPIC_ICR_LO) & ICR_PENDING);
+}
+
+/* Arranca el primer AP con la secuencia INIT-SIPI-SIPI. Si no hay otro
+ * procesador el BSP sigue pintando por su cuenta en present().*/
+void smp_init(void){
+  u8 *src = ap_trampoline, *dst = (u8*) AP_TRAMPOLINE, bsp;
+  u32 i, a, b, c, d;
+
+  // Estado de la cola antes de que arranque el AP, sin depender de la .bss
+  frame_head = frame_tail = 0;
+  frames_presented = frames_dropped = frame_shown_seq = 0;
+  ap_running = false;
+
+  asm volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (1));
+  if(!(d & (1 << 9))) return;  // Sin APIC local
+  if(!acpi_cpus() && !mp_cpus()) return;
+
+  while(src < ap_trampoline_end) *dst++ = *src++;
+  bsp = lapic_read(LAPIC_ID) >> 24;
+  for(i = 0; i < ncpus; i++){
+    if(cpus[i] == bsp) continue;
+    send_ipi(cpus[i], ICR_INIT);
+    delay(10);
+    send_ipi(cpus[i], ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+    delay(1);
+    if(!ap_running) send_ipi(cpus[i], ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+    for(a = 0; a < 100 && !ap_running; a++) delay(1);
+    return;
+  }
+}
+
+/* Publica la pantalla actual si cambió desde el último cuadro publicado. Si la
+ * cola está llena el cuadro se descarta, la simulación nunca espera al núcleo
+ * que pinta.*/
+void present(void){
+  if(!ap_running){
+    show(screen);
+    return;
+  }
+  if(frame_head && same_cells(frames[(frame_head - 1) % FRAME_QUEUE].cells, screen))
+    return;
+  if(frame_head - frame_tail == FRAME_QUEUE){
+    frames_dropped++;
+    return;
+  }
+  copy_cells(frames[frame_head % FRAME_QUEUE].cells, screen);
+  barrier();
+  frame_head++;
+}
+
+/* Punto de entrada del AP (boot.asm): copia a la VGA el cuadro más reciente de
+ * la cola y descarta los que se hayan acumulado.*/
+void ap_main(void){
+  ap_running = true;
+  for(;;){
+    u32 head = frame_head;
+    barrier();    // Las celdas del cuadro se leen después de ver head
+    if(head == frame_tail){
+      asm volatile("pause");
+      continue;
+    }
+    if(head - frame_tail > 1) frame_tail = head - 1;
+    show(frames[frame_tail % FRAME_QUEUE].cells);
+    frames_presented++;
+    frame_shown_seq = 0;    // TSC a medio escribir, ver lat_presented()
+    barrier();
+    frame_shown_tsc = rdtsc();
+    barrier();
+    frame_shown_seq = frame_tail + 1;
+    barrier();
+    frame_tail++;
+  }
+}
+
+#else
+/* Sin SMP se muestra en el mismo núcleo; en modo texto el juego ya escribe
+ * directo en la VGA.*/
+void present(void){
+  show(screen);
+}
+#endif
+
+/*==============================================================================
+                              LATENCIA DE ENTRADA
+==============================================================================*/
+/* Para cada tecla que mueve al jugador se marca el TSC en cada etapa: scan()
+ * lee el scancode, move_player() lo aplica, draw() escribe el '@' y el cuadro
+ * llega a la VGA. Con SMP la última etapa la marca el núcleo que pinta, al
+ * mostrar un cuadro con número de secuencia igual o mayor al del cambio. Las
+ * últimas LAT_EVENTS mediciones quedan en un anillo para el reporte (tecla L)
+ * y el benchmark.*/
+enum lat_stage {
+  LAT_SCAN,
+  LAT_SIM,
+  LAT_CELL,
+  LAT_SHOWN,
+  LAT__LENGTH
+};
+
+/* En el anillo la columna 0 es el total y la columna i la etapa i - 1 -> i.*/
+const char *lat_names[LAT__LENGTH] = {"total", "scan_sim", "sim_cell", "cell_shown"};
+
+u64 lat_t[LAT__LENGTH];          // Marcas del evento en curso
+u32 lat_seq = 0;                 // Cuadro que lleva el cambio (SMP)
+bool lat_active = false;
+u64 lat_scan = 0;                // TSC de la última tecla leída
+u32 lat_log[LAT_EVENTS][LAT__LENGTH];
+u32 lat_count = 0;               // Eventos medidos desde el arranque
+u32 lat_sorted[LAT_EVENTS];
+
+/* La tecla leída por scan() se aplicó al juego.*/
+void lat_begin(void){
+  lat_t[LAT_SCAN] = lat_scan;
+  lat_t[LAT_SIM] = rdtsc();
+  lat_t[LAT_CELL] = 0;
+  lat_active = true;
+}
+
+/* draw() escribió el '@'.*/
+void lat_cell(void){
+  if(!lat_active || lat_t[LAT_CELL]) return;
+  lat_t[LAT_CELL] = rdtsc();
+#ifdef SMP
+  lat_seq = frame_head + 1;
+#endif
+}
+
+/* Se llama después de present(): cierra el evento si el cambio ya se ve.*/
+void lat_presented(void){
+  u32 *e = lat_log[lat_count % LAT_EVENTS], i;
+  if(!lat_active || !lat_t[LAT_CELL]) return;
+#ifdef SMP
+  if(ap_running){
+    // En 32 bits el TSC se lee en dos mitades: se reintenta si el AP lo
+    // escribió entremedio (seq cambió) o lo está escribiendo (seq = 0)
+    u32 seq;
+    do {
+      seq = frame_shown_seq;
+      barrier();
+      lat_t[LAT_SHOWN] = frame_shown_tsc;
+      barrier();
+    } while(seq != frame_shown_seq);
+    if(!seq || (s32) (seq - lat_seq) < 0) return;
+  }
+  else
+#endif
+  lat_t[LAT_SHOWN] = rdtsc();
+  e[0] = (u32) (lat_t[LAT_SHOWN] - lat_t[LAT_SCAN]);
+  for(i = 1; i < LAT__LENGTH; i++) e[i] = (u32) (lat_t[i] - lat_t[i - 1]);
+  lat_count++;
+  lat_active = false;
+}
+
+/* Retorna el percentil pct de la columna col del anillo, en ciclos.*/
+u32 lat_percentile(u32 col, u32 pct){
+  u32 n = lat_count < LAT_EVENTS ? lat_count : LAT_EVENTS, i, j, v;
+  if(!n) return 0;
+  for(i = 0; i < n; i++){
+    v = lat_log[i][col];
+    for(j = i; j > 0 && lat_sorted[j - 1] > v; j--) lat_sorted[j] = lat_sorted[j - 1];
+    lat_sorted[j] = v;
+  }
+  return lat_sorted[(n - 1) * pct / 100];
+}
+
+/* Ciclos a microsegundos.*/
+u32 lat_us(u32 cycles){
+  return tpms ? (u32) div64((u64) cycles * 1000, (u32) tpms) : 0;
+}
+
+void draw_latency(void){
+  static const u8 pcts[4] = {50, 90, 99, 100};
+  u32 i, j;
+  puts(24, 3, BRIGHT | CYAN, BLACK, "Input latency (us)");
+  puts(24, 4, GRAY, BLACK, "Events:");
+  puts(33, 4, BRIGHT | GRAY, BLACK, itoa(lat_count, 10, 6));
+  puts(24, 6, GRAY, BLACK, "Stage          p50    p90    p99    max");
+  for(i = 0; i < LAT__LENGTH; i++){
+    puts(24, 8 + i, BRIGHT | GRAY, BLACK, lat_names[i]);
+    for(j = 0; j < 4; j++)
+      puts(37 + j * 7, 8 + i, BRIGHT | GRAY, BLACK, itoa(lat_us(lat_percentile(i, pcts[j])), 10, 6));
+  }
+  puts(24, 20, BLACK, YELLOW, "Continue");
+}
+
+#ifdef BENCH
+/*==============================================================================
+                              BENCHMARK
+==============================================================================*/
+#define DEBUGCON     (0xE9)  // Puerto de -debugcon en QEMU
+#define DEBUG_EXIT   (0xF4)  // Puerto de -device isa-debug-exit
+#define BENCH_DONE      (0)  // QEMU termina con estado (código << 1) | 1
+#define BENCH_GAME_OVER (1)
+
+u64 bench_boot, bench_t0, bench_end, bench_next, bench_cycles, bench_frame_cycles;
+u32 bench_frames = 0, bench_ticks = 0, bench_step = 0;
+
+/* Ciclos y llamadas de cada ruta caliente de la simulación, ver HOT().*/
+enum hot {
+  HOT_ENEMIES,
+  HOT_BULLETS,
+  HOT_WALLS,
+  HOT__LENGTH
+};
+const char *hot_names[HOT__LENGTH] = {"move_enemies", "move_bullets", "move_walls"};
+u64 hot_cycles[HOT__LENGTH];
+u32 hot_calls[HOT__LENGTH];
+
+#define HOT(h, call) do { \
+    u64 t_ = rdtsc(); \
+    call; \
+    hot_cycles[h] += rdtsc() - t_; \
+    hot_calls[h]++; \
+  } while(0)
+
+void dputs(const char *s){
+  for (; *s; s++)
+    outb(DEBUGCON, *s);
+}
+
+/* Escribe un número en decimal sin ceros a la izquierda.*/
+void dputn(u64 n){
+  char s[21];
+  u8 i = 20;
+  s[20] = 0;
+  do {
+    u64 q = div64(n, 10);
+    s[--i] = '0' + (n - q * 10);
+    n = q;
+  } while (n);
+  dputs(s + i);
+}
+
+/* Escribe "bench <a><b><c>=<v>", la clave puede armarse de tres partes.*/
+void dputkv3(const char *a, const char *b, const char *c, u64 v){
+  dputs("bench ");
+  dputs(a);
+  dputs(b);
+  dputs(c);
+  dputs("=");
+  dputn(v);
+  dputs("\n");
+}
+
+void dputkv(const char *k, u64 v){
+  dputkv3(k, "", "", v);
+}
+
+/* Empieza el escenario, requiere tpms calibrado.*/
+void bench_start(void){
+  bench_t0 = rdtsc();
+  bench_next = bench_t0 + tpms * BENCH_KEY_MS;
+}
+
+/* Teclas del escenario: Enter en el menú principal y en el de niveles, luego
+ * el jugador va y viene BENCH_SWEEP pasos a cada lado.*/
+u8 bench_key(void){
+  u64 t = rdtsc();
+  if(t < bench_next) return 0;
+  bench_next = t + tpms * BENCH_KEY_MS;
+  if(bench_step < 2){
+    if(++bench_step == 2) bench_end = t + tpms * BENCH_MS;
+    return KEY_ENTER;
+  }
+  return (bench_step++ / BENCH_SWEEP) % 2 ? KEY_LEFT : KEY_RIGHT;
+}
+
+/* Reporta los resultados por debugcon y apaga QEMU con isa-debug-exit.*/
+void bench_finish(u8 status){
+  u32 i;
+  dputkv("boot_cycles", bench_boot);
+  dputkv("frames", bench_frames);
+  dputkv("ticks", bench_ticks);
+  dputkv("sim_steps", sim_steps);
+  dputkv("sim_dropped_steps", sim_dropped);
+  dputkv("avg_tick_cycles", bench_ticks ? div64(bench_cycles, bench_ticks) : 0);
+  dputkv("avg_frame_cycles", bench_frames ? div64(bench_frame_cycles, bench_frames) : 0);
+  for(i = 0; i < HOT__LENGTH; i++)
+    dputkv3("avg_", hot_names[i], "_cycles", hot_calls[i] ? div64(hot_cycles[i], hot_calls[i]) : 0);
+  dputkv("gov_late_frames", gov_late);
+  dputkv("gov_avg_over_cycles", gov_late ? div64(gov_over, gov_late) : 0);
+  dputkv("gov_degrades", gov_ups);
+  dputkv("gov_recovers", gov_downs);
+  for(i = 0; i < GOV__LENGTH; i++)
+    dputkv3("gov_", gov_names[i], "_frames", gov_frames[i]);
+#ifdef SMP
+  dputkv("frames_presented", frames_presented);
+  dputkv("frames_dropped", frames_dropped);
+#endif
+#ifdef MODE13H
+  dputkv("render_frames", gfx_frames);
+  if(gfx_frames){
+    dputkv("avg_render_cycles", div64(gfx_cycles, gfx_frames));
+    dputkv("render_bytes_per_frame", div64(gfx_bytes, gfx_frames));
+    dputkv("glyphs_per_frame", gfx_glyphs / gfx_frames);
+    dputkv("sprites_per_frame", gfx_sprites / gfx_frames);
+  }
+#endif
+  dputkv("lat_events", lat_count);
+  for(i = 0; i < LAT__LENGTH; i++){
+    dputkv3("lat_", lat_names[i], "_p50_cycles", lat_percentile(i, 50));
+    dputkv3("lat_", lat_names[i], "_p99_cycles", lat_percentile(i, 99));
+  }
+  dputkv("score", score);
+  dputkv("status", status);
+  outb(DEBUG_EXIT, status);
+  for(;;) asm volatile("cli; hlt");
+}
+
+/* Registra una iteración del loop de juego: sim ciclos de simulación, que
+ * cuentan como tick si avanzó algún timer, y frame ciclos de draw() y present().*/
+void bench_tick(u64 sim, u64 frame, bool ticked){
+  if(ticked){
+    bench_ticks++;
+    bench_cycles += sim;
+  }
+  bench_frames++;
+  bench_frame_cycles += frame;
+  if(bench_end && rdtsc() >= bench_end) bench_finish(BENCH_DONE);
+}
+
+#else
+#define HOT(h, call) call
+#endif
+
 /*==============================================================================
                               ESCANEO DE TECLAS
 ==============================================================================*/
 u8 scan(void){
+#ifdef BENCH
+  u8 key = bench_key();
+  if(key) lat_scan = rdtsc();
+  return key;
+#else
   static u8 key = 0;
   u8 scan = inb(0x60);
-  if(scan != key)
+  if(scan != key){
+    lat_scan = rdtsc();
     return key = scan;
+  }
   else
     return 0;
+#endif
+}
+
+/*==============================================================================
+                              NIVELES
+==============================================================================*/
+/* Los niveles vienen de un paquete binario que el Makefile pone en el disco
+ * justo después del kernel (ver mklevels.py): un sector de encabezado y un
+ * sector por nivel. Al arrancar solo se lee el encabezado; el registro de cada
+ * nivel se lee a level_buf al empezarlo.*/
+#ifndef KERNEL_SECTORS
+#define KERNEL_SECTORS (52)   // Lo define el Makefile, igual que en boot.asm
+#endif
+#define PACK_LBA      (KERNEL_SECTORS + 1)
+#define PACK_VERSION  (1)
+#define PACK_MAX      (9)     // Niveles que caben en el menú
+#define SECTOR        (512)
+
+/* Banderas de un nivel */
+#define LEVEL_BULLETS (1 << 0)  // El jugador dispara
+#define LEVEL_ESCAPE  (1 << 1)  // Los enemigos que llegan abajo quitan una vida
+#define LEVEL_MOVING  (1 << 2)  // La pared va y viene entre wall_min y wall_max
+#define LEVEL_PAIRS   (1 << 3)  // Los enemigos pueden aparecer de dos en dos
+
+struct pack_header {
+  char magic[4];      // "LEAD"
+  u16 version;
+  u16 count;          // Niveles en el paquete
+};
+
+/* Registro de un nivel, en el mismo orden que mklevels.py.*/
+struct level {
+  u16 length;         // Ticks de pared para pasar el nivel
+  u16 spawn_every;    // Ticks de pared entre enemigos, 0 = ninguno
+  u16 enemy_speed;    // Intervalo en ms para aplicar gravedad a los enemigos
+  u16 wall_speed;     // Intervalo en ms para aplicar gravedad a la pared
+  u16 bullet_speed;   // Intervalo en ms para mover las balas
+  u8 label;           // Carácter de la señal de nivel "-n-"
+  u8 color;           // Color de la pared y de la señal
+  u8 wall_start;      // Columna inicial de la pared izquierda
+  u8 wall_len;        // Ancho entre paredes
+  u8 wall_min;        // Límites del vaivén de la pared izquierda
+  u8 wall_max;
+  u8 wall_delay;      // Ticks de pared antes de empezar a moverse
+  u8 wall_pause;      // Ticks de pausa en cada extremo, 0 = sin pausa
+  u8 spawn_range;     // Los enemigos aparecen en rand(spawn_range) + spawn_offset
+  u8 spawn_offset;    // columnas desde la pared izquierda
+  u8 flags;
+};
+
+extern bool disk_read(u32 lba, void *dst);   // Ver boot.asm
+
+u8 level_buf[SECTOR];            // Último sector leído del paquete
+u16 levels = 0;                  // Niveles disponibles, 0 si no hay paquete
+const struct level *level;       // Nivel en juego
+
+/* El nivel de estrés no está en el paquete, se arma con config.h.*/
+const struct level stress_level = {
+  2000, 0, STRESS_ENEMY_SPEED, STRESS_WALL_SPEED, STRESS_BULLET_SPEED,
+  'S', GRAY, 1, STRESS_WALL, 0, 0, 0, 0, 0, 0, LEVEL_BULLETS
+};
+
+/* Lee y valida el encabezado del paquete de niveles.*/
+void pack_init(void){
+  struct pack_header *h = (struct pack_header*) level_buf;
+  if(disk_read(PACK_LBA, level_buf) && signature((u8*) h->magic, "LEAD", 4) &&
+     h->version == PACK_VERSION)
+    levels = h->count > PACK_MAX ? PACK_MAX : h->count;
+}
+
+/* Lee del disco el registro del nivel n (desde 0).*/
+bool load_level(u32 n){
+  if(n >= levels || !disk_read(PACK_LBA + 1 + n, level_buf)) return false;
+  level = (const struct level*) level_buf;
+  return true;
+}
+
+/* Deja el juego listo para empezar el nivel actual.*/
+void reset_level(void){
+  clear(BLACK);
+  enemigo = disparos = pared = 0;
+  playerX = 39, playerY = 22;
+  life = LIFES;
+  wallStart = level->wall_start;
+  wallOption = 'I';
+  wallInterval = level->wall_pause;
+  speed_e = level->enemy_speed;
+  speed_w = level->wall_speed;
+  speed_b = level->bullet_speed;
+  for(u32 i = 0; i < TIMER__LENGTH; i++) timers[i] = sim_ms;
+  sim_reset();
+  gov_reset();
+}
+
+/*==============================================================================
+                              INSTANTÁNEAS
+==============================================================================*/
+/* Cada SNAP_EVERY ticks de pared se guarda el estado del juego en un anillo de
+ * SNAP_LOG bytes. Cada SNAP_KEY instantáneas una es completa (clave) y las
+ * demás guardan solo lo que cambió respecto a la última clave. En ambos casos
+ * se guarda el XOR contra una base (la pantalla vacía o la clave) comprimido
+ * como tramos [u16 bytes iguales][u16 bytes distintos][bytes distintos].
+ * Cuando el anillo se llena se descarta la clave más vieja con sus deltas.*/
+#define SNAP_ENTRIES (64)
+
+struct snapshot {
+  u16 cells[ROWS * COLS];     // Pantalla: paredes, enemigos, balas y jugador
+  struct level level;
+  u32 score, life, pared, enemigo, disparos, seed;
+  u32 playerX, playerY, wallStart, wallInterval, swapColor;
+  u32 timers[TIMER__LENGTH];  // ms simulados hasta el próximo disparo
+  char wallOption, option;
+};
+
+struct snap_entry {
+  u32 off, size;
+  bool key;
+};
+
+u8 snap_log[SNAP_LOG];
+struct snap_entry snaps[SNAP_ENTRIES];
+u32 snap_first = 0, snap_count = 0, snap_head = 0, snap_since_key = 0;
+struct snapshot snap_cur, snap_key, snap_tmp;
+u8 snap_enc[sizeof(struct snapshot) * 2];
+
+#define SNAP(i) (snaps[(snap_first + (i)) % SNAP_ENTRIES])
+
+/* Estado base de las claves: pantalla negra y todo lo demás en cero.*/
+void snap_blank(struct snapshot *s){
+  u8 *p = (u8*) s;
+  u32 i;
+  for(i = 0; i < sizeof(struct snapshot); i++) p[i] = 0;
+  for(i = 0; i < ROWS * COLS; i++) s->cells[i] = ' ';
+}
+
+void snap_capture(struct snapshot *s){
+  u32 i;
+  copy_cells(s->cells, screen);
+  copy_bytes(&s->level, level, sizeof(struct level));
+  s->score = score, s->life = life, s->seed = seed;
+  s->pared = pared, s->enemigo = enemigo, s->disparos = disparos;
+  s->playerX = playerX, s->playerY = playerY;
+  s->wallStart = wallStart, s->wallInterval = wallInterval, s->swapColor = swapColor;
+  s->wallOption = wallOption, s->option = option;
+  for(i = 0; i < TIMER__LENGTH; i++)
+    s->timers[i] = timers[i] - sim_ms;
+}
+
+void snap_apply(const struct snapshot *s){
+  u32 i;
+  copy_cells(screen, s->cells);
+  if(s->option == 'S') level = &stress_level;
+  else {
+    copy_bytes(level_buf, &s->level, sizeof(struct level));
+    level = (const struct level*) level_buf;
+  }
+  score = s->score, life = s->life, seed = s->seed;
+  pared = s->pared, enemigo = s->enemigo, disparos = s->disparos;
+  playerX = s->playerX, playerY = s->playerY;
+  wallStart = s->wallStart, wallInterval = s->wallInterval, swapColor = s->swapColor;
+  wallOption = s->wallOption, option = s->option;
+  speed_e = level->enemy_speed, speed_w = level->wall_speed, speed_b = level->bullet_speed;
+  for(i = 0; i < TIMER__LENGTH; i++)
+    timers[i] = sim_ms + s->timers[i];
+  game_over = false;
+  sim_reset();
+}
+
+/* Codifica cur XOR base en out, retorna el tamaño. Un tramo distinto termina
+ * antes de 4 bytes iguales seguidos o de los iguales del final.*/
+u32 snap_encode(const u8 *cur, const u8 *base, u32 n, u8 *out){
+  u32 i = 0, o = 0;
+  while(i < n){
+    u32 skip = 0, len = 0, same = 0, start;
+    while(i < n && cur[i] == base[i] && skip < 0xFFFF) i++, skip++;
+    if(i == n) break;
+    for(start = i; i < n && len < 0xFFFF; i++, len++){
+      for(same = 0; same < 4 && i + same < n && cur[i + same] == base[i + same]; same++);
+      if(same == 4 || i + same == n) break;
+    }
+    out[o++] = skip, out[o++] = skip >> 8;
+    out[o++] = len, out[o++] = len >> 8;
+    for(; start < i; start++) out[o++] = cur[start] ^ base[start];
+  }
+  return o;
+}
+
+/* Aplica en state, que debe tener la base, los tramos de una instantánea.*/
+void snap_decode(const u8 *in, u32 size, u8 *state){
+  u32 i = 0, pos = 0;
+  while(i < size){
+    u32 len = in[i + 2] | in[i + 3] << 8;
+    pos += in[i] | in[i + 1] << 8;
+    for(i += 4; len--; ) state[pos++] ^= in[i++];
+  }
+}
+
+/* Reconstruye en s la instantánea i, partiendo de su clave.*/
+void snap_restore(u32 i, struct snapshot *s){
+  u32 k = i;
+  while(!SNAP(k).key) k--;
+  snap_blank(s);
+  snap_decode(snap_log + SNAP(k).off, SNAP(k).size, (u8*) s);
+  if(k != i) snap_decode(snap_log + SNAP(i).off, SNAP(i).size, (u8*) s);
+}
+
+void snap_reset(void){
+  snap_first = snap_count = snap_head = snap_since_key = 0;
+}
+
+/* Descarta la instantánea más vieja, que siempre es una clave, y los deltas
+ * que dependen de ella.*/
+void snap_evict(void){
+  do {
+    snap_first = (snap_first + 1) % SNAP_ENTRIES;
+    snap_count--;
+  } while(snap_count && !SNAP(0).key);
+}
+
+/* Codifica el estado actual como clave o delta, retorna el tamaño.*/
+u32 snap_pack(bool key){
+  if(!key)
+    return snap_encode((u8*) &snap_cur, (u8*) &snap_key, sizeof(struct snapshot), snap_enc);
+  snap_blank(&snap_tmp);
+  return snap_encode((u8*) &snap_cur, (u8*) &snap_tmp, sizeof(struct snapshot), snap_enc);
+}
+
+/* Libera espacio en el anillo para n bytes en snap_head. Lo ocupado va desde
+ * la cola (la clave más vieja) hasta snap_head, dando la vuelta si la cola
+ * quedó por encima de snap_head. Al volver a 0 se abandona el espacio que
+ * sobra al final del anillo.*/
+void snap_room(u32 n){
+  u32 tail;
+  for(;;){
+    if(snap_count == SNAP_ENTRIES){
+      snap_evict();
+      continue;
+    }
+    if(!snap_count){
+      if(snap_head + n > SNAP_LOG) snap_head = 0;
+      return;
+    }
+    tail = SNAP(0).off;
+    if(tail < snap_head){             // Ocupado [tail, snap_head)
+      if(snap_head + n <= SNAP_LOG) return;
+      if(n <= tail){
+        snap_head = 0;
+        return;
+      }
+    }
+    else if(snap_head + n <= tail) return;  // Libre [snap_head, tail)
+    snap_evict();
+  }
+}
+
+void snap_take(void){
+  struct snap_entry *e;
+  bool key = !snap_count || snap_since_key + 1 >= SNAP_KEY;
+  u32 n;
+
+  snap_capture(&snap_cur);
+  n = snap_pack(key);
+  if(!key && n > SNAP_LOG / 8) n = snap_pack(key = true);
+  if(n > SNAP_LOG / 2) return;
+  snap_room(n);
+  if(!key && !snap_count){        // Se descartó su clave
+    n = snap_pack(key = true);
+    snap_room(n);
+  }
+
+  copy_bytes(snap_log + snap_head, snap_enc, n);
+  e = &SNAP(snap_count);
+  e->off = snap_head, e->size = n, e->key = key;
+  snap_head += n;
+  snap_count++;
+  if(key){
+    copy_bytes(&snap_key, &snap_cur, sizeof(struct snapshot));
+    snap_since_key = 0;
+  }
+  else snap_since_key++;
+}
+
+/* Vuelve a la instantánea más reciente y la saca del anillo, así cada llamada
+ * retrocede un poco más. Retorna false si no hay instantáneas.*/
+bool snap_rewind(void){
+  u32 i;
+  if(!snap_count) return false;
+  snap_restore(--snap_count, &snap_tmp);
+  snap_apply(&snap_tmp);
+  snap_head = SNAP(snap_count).off;
+  if(SNAP(snap_count).key && snap_count){
+    for(i = snap_count - 1; !SNAP(i).key; i--);
+    snap_restore(i, &snap_key);
+    snap_since_key = snap_count - 1 - i;
+  }
+  else if(snap_count) snap_since_key--;
+  return true;
 }
 
 /*==============================================================================
@@ -217,8 +1399,8 @@ u8 scan(void){
 void move_char(int row,int column,int row_direction,int column_direction, char nc) {
   char c;
   u16 actual_char, replacemente_char;
-  actual_char = vga[row*COLS + column];
-  replacemente_char = vga[(row+row_direction)*COLS + (column+column_direction)];
+  actual_char = screen[row*COLS + column];
+  replacemente_char = screen[(row+row_direction)*COLS + (column+column_direction)];
   enum color fg,bg;
 
   bg = (actual_char & 0xF000) >> 12;
@@ -236,6 +1418,15 @@ void move_char(int row,int column,int row_direction,int column_direction, char n
 }
 
 void create_wall(int column, int len,enum color fg,enum color bg,char c) {
+  if(gov >= GOV_WALL){
+    u16 *row = screen + 2 * COLS;
+    fill_cells(row, column, '|');
+    putc(column,2,fg,bg,c);
+    putc(column+len,2,fg,bg,c);
+    if(column + len + 1 < COLS)
+      fill_cells(row + column + len + 1, COLS - (column + len + 1), '|');
+    return;
+  }
   for(int i = 0; i < column; i++){
     putc(i,2,BLACK,BLACK,'|');
   }
@@ -274,6 +1465,8 @@ void move_walls(){
 }
 
 void move_enemies(){
+  u32 n = 0;
+  bool hit = false;
   for (int i = 22; i >= 0; i--){
     for (int j = 0; j < 80; j++){
       char c = getc(j,i);
@@ -281,26 +1474,31 @@ void move_enemies(){
          c == '*' || c == '.'){
         if(i == 22){
           putc(j,i, BLACK,BLACK,' ');
-          if((option == '1' || option == '3') && --life == 0){
+          if((level->flags & LEVEL_ESCAPE) && --life == 0){
             game_over = true;
           }
         }
         if(getc(j,i+1) == '@'){
           putc(j,i, BLACK,BLACK,' ');
-          if(--life == 0){
-            game_over = true;
-          }
-          return;
+          hit = true;
+        }
+        else {
+          if(i < 22) n++;
+          move_char(i,j,1,0, '-');
         }
-        else move_char(i,j,1,0, '-');
       }
     }
   }
+  live_enemies = n;
+  if(hit && option != 'S' && --life == 0){
+    game_over = true;
+  }
 }
 
-void move_player(u32 direction){
+/* Retorna false si una pared bloquea el movimiento.*/
+bool move_player(u32 direction){
   if(getc(playerX+direction, playerY) == '|'){
-    return;
+    return false;
   }
   move_char(playerX, playerY, 0, direction, '-');
   if(direction == 1){
@@ -309,12 +1507,15 @@ void move_player(u32 direction){
   else{
     putc(playerX--, playerY,BLACK,BLACK,' ');
   }
+  return true;
 }
 
 void move_bullets(void){
+  u32 n = 0;
   for (int i = 0; i < 22; i++){
     for (int j = 0; j < 80; j++){
       if(getc(j,i) == 'o'){
+        if(i > 2) n++;
         if(i == 2){
           putc(j,i, BLACK,BLACK,' ');
         }
@@ -338,80 +1539,55 @@ void move_bullets(void){
       }
     }
   }
+  live_bullets = n;
 }
 
 /*==============================================================================
                               FUNCIONES DE PINTADO
 ==============================================================================*/
+#include "screens.h"   // Plantillas generadas por mkscreens.py desde screens.txt
+
 /* Draw about information in the centre. Shown on boot and pause. */
 void draw_about(void) {
-    puts(TITLE_X + 2,  TITLE_Y,     BLACK,   BRIGHT | YELLOW,  " ");
-    puts(TITLE_X + 3,  TITLE_Y,     BLACK,   BRIGHT | YELLOW,  "   ");
-    puts(TITLE_X + 6,  TITLE_Y,     BLACK,   BRIGHT | YELLOW,  "   ");
-    puts(TITLE_X + 9,  TITLE_Y,     BLACK,   BRIGHT | YELLOW,  "   ");
-    puts(TITLE_X + 12, TITLE_Y,     BLACK,   BRIGHT | YELLOW,  "   ");
-    puts(TITLE_X + 15, TITLE_Y,     BLACK,   BRIGHT | YELLOW,  " ");
-    puts(TITLE_X + 2,  TITLE_Y + 1, BRIGHT | YELLOW, BRIGHT | YELLOW, " ");
-    puts(TITLE_X + 3,  TITLE_Y + 1, BRIGHT | YELLOW, BLACK,   " L ");
-    puts(TITLE_X + 6,  TITLE_Y + 1, BRIGHT | YELLOW, BLACK,   " E ");
-    puts(TITLE_X + 9,  TITLE_Y + 1, BRIGHT | YELLOW, BLACK,   " A ");
-    puts(TITLE_X + 12, TITLE_Y + 1, BRIGHT | YELLOW, BLACK,   " D ");
-    puts(TITLE_X + 15, TITLE_Y + 1, BRIGHT | YELLOW, BRIGHT | YELLOW, " ");
-    puts(TITLE_X + 2,  TITLE_Y + 2, BLACK,   BRIGHT | YELLOW, "   ");
-    puts(TITLE_X + 3,  TITLE_Y + 2, BLACK,   BRIGHT | YELLOW, "   ");
-    puts(TITLE_X + 6,  TITLE_Y + 2, BLACK,   BRIGHT | YELLOW, "   ");
-    puts(TITLE_X + 9,  TITLE_Y + 2, BLACK,   BRIGHT | YELLOW, "   ");
-    puts(TITLE_X + 12, TITLE_Y + 2, BLACK,   BRIGHT | YELLOW, "   ");
-    puts(TITLE_X + 15, TITLE_Y + 2, BLACK,   BRIGHT | YELLOW, " ");
+    blit_template(tpl_about);
 }
 
 /* Draws intro Screnn */
 void draw_intro(char option) {
-    puts(39,5,BLUE,BLACK, "Lead");
-    option == 'G' ? puts(38,10,BLACK,CYAN,"Start") : puts(38,10,BLUE,BLACK,"Start");
-    option == 'L' ? puts(35,11,BLACK,CYAN,"Leaderboard") : puts(35,11,BLUE,BLACK,"Leaderboard");
-    puts(39,15,BLUE,BLACK,"2020");
-    puts(33,16,BLUE,BLACK,"Aymaru Castillo");
-    puts(33,17,BLUE,BLACK,"Alejandro Garita");
-    puts(34,18,BLUE,BLACK,"Alberto Obando");
-    puts(34,21,BLUE,BLACK,"Ernesto Rivera");
+    blit_template(tpl_intro);
+    option == 'G' ? puts(38,10,BLACK,CYAN,"Start") : puts(35,11,BLACK,CYAN,"Leaderboard");
 }
 
 /* Draws intro Screnn */
 void draw_world(char option) {
-    puts(35,5,YELLOW,BLACK, "Select the level");
-    option == '1' ? puts(40,10,BLACK,YELLOW,"Level 1") : puts(40,10,BRIGHT|YELLOW,BLACK,"Level 1");
-    option == '2' ? puts(40,11,BLACK,YELLOW,"Level 2") : puts(40,11,BRIGHT|YELLOW,BLACK,"Level 2");
-    option == '3' ? puts(40,12,BLACK,YELLOW,"Level 3") : puts(40,12,BRIGHT|YELLOW,BLACK,"Level 3");
-    option == '4' ? puts(40,13,BLACK,YELLOW,"Level 4") : puts(40,13,BRIGHT|YELLOW,BLACK,"Level 4");
-    option == 'V' ? puts(75,20,BLACK,YELLOW,"Back") : puts(75,20,BRIGHT|YELLOW,BLACK,"Back");
+    char label[] = "Level 1";
+    u8 i;
+    blit_template(tpl_world);
+    if(!levels) puts(32,10,RED,BLACK, "No level pack found");
+    for(i = 0; i < levels; i++){
+      label[6] = '1' + i;
+      option == label[6] ? puts(40,10+i,BLACK,YELLOW,label) : puts(40,10+i,BRIGHT|YELLOW,BLACK,label);
+    }
+    if(option == 'V') puts(75,20,BLACK,YELLOW,"Back");
 }
 
 /* Draws intro Screnn */
 void draw_leaderboard(char option) {
-    puts(38,4,BLUE,BLACK, "NOT IMPLEMENTED");
-    puts(38,5,BLUE,BLACK, "Leaderboard");
-    puts(38,7,BLUE,BLACK, "Name     Score");
-    puts(38,8,BLUE,BLACK, "AOZ   10000000");
-    puts(38,9,BLUE,BLACK, "AGC    5858588");
-    puts(38,10,BLUE,BLACK,"ACF      40000");
-    puts(38,11,BLUE,BLACK,"FSC          3");
-    option == 'V' ? puts(41,20,BLACK,YELLOW,"Back") : puts(41,20,BRIGHT|YELLOW,BLACK,"Back");
+    blit_template(tpl_leaderboard);
+    if(option == 'V') puts(41,20,BLACK,YELLOW,"Back");
 }
 
 /* Draws intro Screnn */
 void draw_win(char option) {
-    puts(38,9,BLUE,BLACK, "Congratulations");
-    puts(38,10,BLUE,BLACK,"You Won!!!");
-    option == 'V' ? puts(41,20,BLACK,YELLOW,"Continue") : puts(41,20,BRIGHT|YELLOW,BLACK,"Continue");
+    blit_template(tpl_win);
+    if(option == 'V') puts(41,20,BLACK,YELLOW,"Continue");
 }
 
 /* Draws intro Screnn */
 void draw_game_over(char option) {
-    puts(38,9,RED,BLACK, "Game Over");
-    puts(38,10,RED,BLACK,"You Lost");
-    puts(38,11,RED,BLACK,":( :( :( ");
-    option == 'V' ? puts(41,20,BLACK,YELLOW,"Continue") : puts(41,20,BRIGHT|YELLOW,BLACK,"Continue");
+    blit_template(tpl_game_over);
+    if(snap_count) puts(33,13,GRAY,BLACK,"R: back to checkpoint");
+    if(option == 'V') puts(41,20,BLACK,YELLOW,"Continue");
 }
 
 void draw_bullet(){
@@ -422,156 +1598,37 @@ void draw_enemy(u32 pos){
   create_enemy(pos,'X');
 }
 
-void draw_wall(){
-  if(option == '1'){
-    if(pared%3 == 0){
-      if(swapColor > 3){
-        if(swapColor == 8) swapColor = 0;
-        create_wall(wallStart, 40, BRIGHT|RED, BRIGHT|RED, '|');
-        swapColor++;
-      }
-      else{
-        create_wall(wallStart, 40, RED, RED, '|');
-        swapColor++;
-      }
-    }
-    else create_wall(wallStart,40, BLACK, BLACK, '|');
-  }
-  else if(option == '2'){
-    if(pared < 22){
-      if(pared%3 == 0){
-        if(swapColor > 3){
-          if(swapColor == 8) swapColor = 0;
-          create_wall(wallStart, 35, BRIGHT|YELLOW, BRIGHT|YELLOW, '|');
-          swapColor++;
-        }
-        else{
-          create_wall(wallStart, 35, YELLOW, YELLOW, '|');
-          swapColor++;
-        }
-      }
-      else create_wall(wallStart,35, BLACK, BLACK, '|');
-    }
-    else if(wallOption == 'I'){
-      wallStart--;
-      if(wallStart <= 5){
-        wallOption = 'D';
-      }
-      if(pared%3 == 0){
-        if(swapColor > 3){
-          if(swapColor == 8) swapColor = 0;
-          create_wall(wallStart, 35, BRIGHT|YELLOW, BRIGHT|YELLOW, '|');
-          swapColor++;
-        }
-        else{
-          create_wall(wallStart, 35, YELLOW, YELLOW, '|');
-          swapColor++;
-        }
-      }
-      else create_wall(wallStart,35, BLACK, BLACK, '|');
-    }
-    else{
-      wallStart++;
-      if(wallStart >= 40){
-        wallOption = 'I';
-      }
-      if(pared%3 == 0){
-        if(swapColor > 3){
-          if(swapColor == 8) swapColor = 0;
-          create_wall(wallStart, 35, BRIGHT|YELLOW, BRIGHT|YELLOW, '|');
-          swapColor++;
-        }
-        else{
-          create_wall(wallStart, 35, YELLOW, YELLOW, '|');
-          swapColor++;
-        }
-      }
-      else create_wall(wallStart,35, BLACK, BLACK, '|');
-    }
+/* Mueve la pared izquierda entre wall_min y wall_max, con una pausa opcional en
+ * cada extremo: 'I' y 'D' se mueven a la izquierda y derecha, 'J' y 'E' esperan
+ * antes de cambiar de dirección.*/
+void step_wall(){
+  if(!(level->flags & LEVEL_MOVING) || pared < level->wall_delay) return;
+  if(wallOption == 'I'){
+    if(--wallStart <= level->wall_min) wallOption = level->wall_pause ? 'J' : 'D';
   }
-  else if(option == '3'){
-    if(pared < 22){
-      if(pared%3 == 0){
-        if(swapColor > 3){
-          if(swapColor == 8) swapColor = 0;
-          create_wall(wallStart, 35, BRIGHT|BLUE, BRIGHT|BLUE, '|');
-          swapColor++;
-        }
-        else{
-          create_wall(wallStart, 35, BLUE, BLUE, '|');
-          swapColor++;
-        }
-      }
-      else create_wall(wallStart,35, BLACK, BLACK, '|');
-    }
-    else if(wallOption == 'I'){
-      if(--wallStart <= 5){
-        wallOption = 'J';
-      }
-      if(pared%3 == 0){
-        if(swapColor > 3){
-          if(swapColor == 8) swapColor = 0;
-          create_wall(wallStart, 35, BRIGHT|BLUE, BRIGHT|BLUE, '|');
-          swapColor++;
-        }
-        else{
-          create_wall(wallStart, 35, BLUE, BLUE, '|');
-          swapColor++;
-        }
-      }
-      else create_wall(wallStart,35, BLACK, BLACK, '|');
-    }
-    else if(wallOption == 'D'){
-      if(++wallStart >= 40){
-        wallOption = 'E';
-      }
-      if(pared%3 == 0){
-        if(swapColor > 3){
-          if(swapColor == 8) swapColor = 0;
-          create_wall(wallStart, 35, BRIGHT|BLUE, BRIGHT|BLUE, '|');
-          swapColor++;
-        }
-        else{
-          create_wall(wallStart, 35, BLUE, BLUE, '|');
-          swapColor++;
-        }
-      }
-      else create_wall(wallStart,35, BLACK, BLACK, '|');
-    }
-    else{
-      if(wallInterval-- == 0){
-        wallInterval = 22;
-        if(wallOption == 'J') wallOption = 'D';
-        else wallOption = 'I';
-      }
-      if(pared%3 == 0){
-        if(swapColor > 3){
-          if(swapColor == 8) swapColor = 0;
-          create_wall(wallStart, 35, BRIGHT | BLUE, BRIGHT | BLUE, '|');
-          swapColor++;
-        }
-        else{
-          create_wall(wallStart, 35, BLUE, BLUE, '|');
-          swapColor++;
-        }
-      }
-      else create_wall(wallStart,35, BLACK, BLACK, '|');
-    }
+  else if(wallOption == 'D'){
+    if(++wallStart >= level->wall_max) wallOption = level->wall_pause ? 'E' : 'I';
   }
-  else{
-    if(pared%3 == 0){
+  else if(wallInterval-- == 0){
+    wallInterval = level->wall_pause;
+    wallOption = wallOption == 'J' ? 'D' : 'I';
+  }
+}
+
+void draw_wall(){
+  enum color color = level->color;
+  step_wall();
+  if(pared%3 == 0){
+    if(gov < GOV_FLASH){
       if(swapColor > 3){
         if(swapColor == 8) swapColor = 0;
-        create_wall(wallStart, 20, BRIGHT|MAGENTA, BRIGHT|MAGENTA, '|');
-        swapColor++;
-      }
-      else{
-        create_wall(wallStart, 20, MAGENTA, MAGENTA, '|');
-        swapColor++;
+        color |= BRIGHT;
       }
+      swapColor++;
     }
-    else create_wall(wallStart,20, BLACK, BLACK, '|');
+    create_wall(wallStart, level->wall_len, color, color, '|');
   }
+  else create_wall(wallStart, level->wall_len, BLACK, BLACK, '|');
 }
 
 void draw(void){
@@ -586,14 +1643,96 @@ void draw(void){
 
   // DIBUJAR JUGADOR
   putc(playerX, playerY, BLUE, BRIGHT | BLUE, '@');
+  lat_cell();
 
 status:
+  if(!gov_hud()) return;
   if(paused)
     puts(70, 0, BRIGHT | YELLOW, BLACK, "PAUSED");
   puts(36,23, BRIGHT | YELLOW, BLACK, itoa(score, 10, 4));
   puts(41,23, BRIGHT | RED, BLACK, itoa(life, 10, 1));
 }
 
+/*==============================================================================
+                              NIVEL DE ESTRÉS
+==============================================================================*/
+/* Nivel oculto (tecla H en la selección de nivel) para medir cómo escala el
+ * motor con cientos de objetos. Las muestras se agrupan por número de
+ * entidades vivas en grupos de STRESS_BUCKET.*/
+#define STRESS_BUCKETS (ROWS * COLS / STRESS_BUCKET + 1)
+
+struct stress_bucket {
+  u32 ticks;       // Iteraciones con algún tick de simulación
+  u32 frames;      // Iteraciones totales
+  u64 sim;         // Ciclos en move_* y creación de objetos
+  u64 render;      // Ciclos en draw() y present()
+  u64 time;        // Ciclos totales pasados en este grupo
+};
+struct stress_bucket stress[STRESS_BUCKETS];
+u64 stress_last = 0;
+
+void stress_reset(void){
+  u32 i;
+  for(i = 0; i < STRESS_BUCKETS; i++){
+    stress[i].ticks = stress[i].frames = 0;
+    stress[i].sim = stress[i].render = stress[i].time = 0;
+  }
+  live_enemies = live_bullets = 0;
+  stress_last = rdtsc();
+}
+
+/* Llena con probabilidad density% las celdas libres de una fila dentro de las
+ * paredes. Los nuevos se suman a la cuenta hasta la próxima pasada de move_*.*/
+void stress_spawn(u8 row, u32 density, enum color fg, enum color bg, char c){
+  u32 x, n = 0;
+  for(x = wallStart + 1; x < wallStart + STRESS_WALL; x++)
+    if(getc(x, row) == ' ' && rand(100) < density){
+      putc(x, row, fg, bg, c);
+      n++;
+    }
+  if(c == 'o') live_bullets += n;
+  else live_enemies += n;
+}
+
+/* Registra una iteración del loop: t0 al empezar la simulación, t1 al empezar
+ * a pintar y t2 al terminar. Las entidades vivas salen de las cuentas que
+ * llevan move_* y stress_spawn, sin recorrer la pantalla.*/
+void stress_sample(u64 t0, u64 t1, u64 t2, bool ticked){
+  u32 entities = live_enemies + live_bullets;
+  struct stress_bucket *b;
+  if(entities >= ROWS * COLS) entities = ROWS * COLS - 1;
+  b = &stress[entities / STRESS_BUCKET];
+  if(ticked){
+    b->ticks++;
+    b->sim += t1 - t0;
+  }
+  b->frames++;
+  b->render += t2 - t1;
+  b->time += t2 - stress_last;
+  stress_last = rdtsc();
+}
+
+/* Tabla de resultados: ticks medidos por segundo, ciclos por tick y por
+ * cuadro, y los ticks por segundo que alcanzaría solo la simulación.*/
+void draw_stress(void){
+  u32 i, y = 4;
+  puts(29, 1, BRIGHT | YELLOW, BLACK, "Stress level: scaling");
+  puts(4, 3, YELLOW, BLACK, "Entities   Ticks/s  Cycles/tick  Cycles/frame   Max ticks/s");
+  for(i = 0; i < STRESS_BUCKETS && y < 22; i++){
+    struct stress_bucket *b = &stress[i];
+    u32 ms = (u32) div64(b->time, tpms), sim;
+    if(!b->ticks || !ms) continue;
+    sim = (u32) div64(b->sim, b->ticks);
+    puts(4, y, GRAY, BLACK, itoa(i * STRESS_BUCKET, 10, 5));
+    puts(15, y, GRAY, BLACK, itoa((u32) div64((u64) b->ticks * 1000, ms), 10, 7));
+    puts(24, y, GRAY, BLACK, itoa(sim, 10, 11));
+    puts(37, y, GRAY, BLACK, itoa((u32) div64(b->render, b->frames), 10, 13));
+    puts(52, y, GRAY, BLACK, itoa(sim ? (u32) div64(tpms * 1000, sim) : 0, 10, 11));
+    y++;
+  }
+  option == 'V' ? puts(41,22,BLACK,YELLOW,"Continue") : puts(41,22,BRIGHT|YELLOW,BLACK,"Continue");
+}
+
 int valid_vga_position(int row, int column) { //80 columnas y 25 filas (voy a usar 24 para dejar la fila de abajo para el score)
   return (row >= 0 && row < 24 && column >= 0 && column < 80);
 }
@@ -621,9 +1760,26 @@ void create_walls(int row, int column,int len,enum color fg,enum color bg,char c
 }
 
 void kmain(){
+#ifdef BENCH
+  bench_boot = rdtsc();
+#endif
+#ifdef MODE13H
+  gfx_init();
+#endif
   clear(BLACK);
 
+#ifdef PAGING
+  if(pat_enabled){
+    u32 uc, wc;
+    bench_wc(&uc, &wc);
+    puts(20, 20, GRAY, BLACK, "clear() cycles UC:");
+    puts(39, 20, BRIGHT | GRAY, BLACK, itoa(uc, 10, 8));
+    puts(48, 20, GRAY, BLACK, "WC:");
+    puts(52, 20, BRIGHT | GRAY, BLACK, itoa(wc, 10, 8));
+  }
+#endif
   draw_about();
+  present();
 
   // Espera un segundo para calibrar el tiempo.
   u32 itpms;
@@ -631,7 +1787,22 @@ void kmain(){
   itpms = tpms; while(tpms == itpms) tps();
   itpms = tpms; while(tpms == itpms) tps();
 
+#ifdef SMP
+  smp_init();
+#endif
+  pack_init();
+#ifdef BENCH
+  srand(BENCH_SEED);
+  bench_start();
+#else
+  srand((u32) rdtsc());
+#endif
+
   u8 key;
+  u64 tf, t0, t1;   // Inicio de la iteración, de la simulación y del pintado
+  u32 ticks, steps;
+  bool ticked, dirty = false;   // dirty: hay cambios sin presentar
+  bool snap_due = false;        // Instantánea pendiente para el final de la iteración
   swapColor = 0;
   life = LIFES;
   disparos = 0, enemigo = 0;
@@ -655,7 +1826,7 @@ start:
       case KEY_ENTER:
         clear(BLACK);
         if (option == 'G'){
-          option = '1';
+          option = levels ? '1' : 'V';
           goto game;
         }
         else{
@@ -665,6 +1836,7 @@ start:
         break;
     }
   }
+  present();
   goto start;
 
 game:
@@ -674,46 +1846,34 @@ game:
   if((key = scan())) {
     switch(key) {
       case KEY_UP:
-        if(option == '1')      option = 'V';
-        else if(option == '2') option = '1';
-        else if(option == '3') option = '2';
-        else if(option == '4') option = '3';
-        else option = '4';
+        if(option == 'V')      option = levels ? '0' + levels : 'V';
+        else if(option == '1') option = 'V';
+        else option--;
         break;
       case KEY_DOWN:
-        if(option == '1')      option = '2';
-        else if(option == '2') option = '3';
-        else if(option == '3') option = '4';
-        else if(option == '4') option = 'V';
-        else option = '1';
+        if(option == 'V')      option = levels ? '1' : 'V';
+        else if(option == '0' + levels) option = 'V';
+        else option++;
         break;
       case KEY_ENTER:
-        clear(BLACK);
-        life = LIFES;
-        if(option == '1'){
-          wallStart = 20;
-          goto loop;
-        }
-        else if(option == '2'){
-          wallOption = 'I';
-          wallStart = 25;
-          goto loop;
-        }
-        else if(option == '3'){
-          wallOption = 'I';
-          wallStart = 25;
-          wallInterval = 22;
-          goto loop;
+        if(option == 'V'){clear(BLACK); option = 'G'; goto start;}
+        if(load_level(option - '1')){
+          reset_level();
+          snap_reset();
+          goto play;
         }
-        else if(option == '4'){
-          wallStart = 30;
-          goto loop;
-        }
-        else{option = 'G'; goto start;}
         break;
+      case KEY_H:
+        option = 'S';
+        level = &stress_level;
+        reset_level();
+        stress_reset();
+        snap_reset();
+        goto play;
     }
   }
 
+  present();
   goto game;
 
 leaderboard:
@@ -730,13 +1890,20 @@ leaderboard:
     }
   }
 
+  present();
   goto leaderboard;
 
 gameover:
+#ifdef BENCH
+  bench_finish(BENCH_GAME_OVER);
+#endif
   draw_game_over(option);
 
   if((key = scan())) {
     switch(key) {
+      case KEY_R:         // Reinicia desde la última instantánea
+        if(snap_rewind()) goto play;
+        break;
       case KEY_ENTER:
         clear(BLACK);
         game_over = false;
@@ -746,9 +1913,13 @@ gameover:
     }
   }
 
+  present();
   goto gameover;
 
 won:
+#ifdef BENCH
+  bench_finish(BENCH_DONE);
+#endif
   draw_win(option);
 
   if((key = scan())) {
@@ -762,93 +1933,124 @@ won:
     }
   }
 
+  present();
   goto won;
 
+stress_report:
+  draw_stress();
+
+  if((key = scan())) {
+    switch(key) {
+      case KEY_ENTER:
+        clear(BLACK);
+        option = 'G';
+        goto start;
+        break;
+    }
+  }
+
+  present();
+  goto stress_report;
+
+latency_report:
+  draw_latency();
+
+  if((key = scan())) {
+    switch(key) {
+      case KEY_ENTER:
+        snap_apply(&snap_cur);
+        goto play;
+        break;
+    }
+  }
+
+  present();
+  goto latency_report;
+
+play:
+  // Al entrar desde otro estado el primer cuadro siempre se presenta
+  dirty = true;
+  snap_due = false;
+
 loop:
   // INICIO
+  tf = rdtsc();
   tps();    //Mantiene los timers calibrados.
 
-  if(debug) {
+  if(debug && gov_hud()) {
     puts(1,23, BLUE, BRIGHT | BLUE, "Enemigos: ");
     puts(11,23, BLUE, BRIGHT | BLUE, itoa(enemigo, 10, 4));
     puts(1,24, GREEN, BRIGHT | GREEN, "Disparos: ");
     puts(11,24, GREEN, BRIGHT | GREEN, itoa(disparos, 10, 4));
     puts(16,23, RED, BRIGHT | RED, "Paredes: ");
     puts(25,23, RED, BRIGHT | RED, itoa(pared, 10, 4));
+    puts(46,23, MAGENTA, BRIGHT | MAGENTA, "Gob: ");
+    puts(51,23, MAGENTA, BRIGHT | MAGENTA, itoa(gov, 10, 1));
+    puts(53,23, MAGENTA, BRIGHT | MAGENTA, "Atrasos: ");
+    puts(62,23, MAGENTA, BRIGHT | MAGENTA, itoa(gov_late, 10, 6));
+#ifdef SMP
+    puts(16,24, GRAY, BRIGHT | GRAY, "Cuadros: ");
+    puts(25,24, GRAY, BRIGHT | GRAY, itoa(frames_presented, 10, 4));
+    puts(30,24, GRAY, BRIGHT | GRAY, "Perdidos: ");
+    puts(40,24, GRAY, BRIGHT | GRAY, itoa(frames_dropped, 10, 4));
+#endif
+#ifdef MODE13H
+    puts(44,24, CYAN, BRIGHT | CYAN, "Render kc: ");
+    puts(55,24, CYAN, BRIGHT | CYAN, itoa(gfx_last / 1000, 10, 5));
+    puts(61,24, CYAN, BRIGHT | CYAN, "Sprites: ");
+    puts(70,24, CYAN, BRIGHT | CYAN, itoa(gfx_sprites, 10, 8));
+#endif
   }
 
   // ACTUALIZAR SCORE
 
   // SEÑAL DE NIVEL
-  if(option == '1'){
-    speed_b = BULLET_SPEED;
-    speed_e = ENEMY_1_SPEED;
-    speed_w = WALL_1_SPEED;
-    puts(1,0,RED, BRIGHT | RED, "-1-");
-  }
-  if(option == '2'){
-    speed_b = 0;
-    speed_e = ENEMY_2_SPEED;
-    speed_w = WALL_2_SPEED;
-    puts(1,0,YELLOW, BRIGHT | YELLOW, "-2-");
-  }
-  if(option == '3'){
-    speed_b = BULLET_SPEED;
-    speed_e = ENEMY_3_SPEED;
-    speed_w = WALL_3_SPEED;
-    puts(1,0,BLUE, BRIGHT | BLUE, "-3-");}
-  if(option == '4'){
-    speed_b = 0;
-    speed_e = ENEMY_4_SPEED;
-    speed_w = WALL_4_SPEED;
-    puts(1,0,MAGENTA, BRIGHT | MAGENTA, "-4-");
+  if(gov_hud()){
+    putc(1,0, level->color, BRIGHT | level->color, '-');
+    putc(2,0, level->color, BRIGHT | level->color, level->label);
+    putc(3,0, level->color, BRIGHT | level->color, '-');
   }
 
   // SI PRESIONO TECLA
   if((key = scan())) {
     switch(key) {
       case KEY_LEFT:      // Izquierda
-        move_player(-1);
+        if(move_player(-1) && !paused) lat_begin();
         break;
       case KEY_RIGHT:     // Derecha
-        move_player(1);
+        if(move_player(1) && !paused) lat_begin();
         break;
+      case KEY_L:         // Reporte de latencia, el juego sigue al volver
+        snap_capture(&snap_cur);
+        clear(BLACK);
+        goto latency_report;
       case KEY_D:
         debug = !debug;
         puts(1,23, BLACK, BLACK, "                               ");
-        puts(1,24, BLACK, BLACK, "              ");
+        puts(46,23, BLACK, BLACK, "                      ");
+        puts(1,24, BLACK, BLACK, "                                                                              ");
         break;        // Activar debug
       case KEY_P:         // Pausa
         paused = !paused;
         puts(70, 0, BLACK, BLACK, "      ");
+        if(!paused) sim_reset();    // El tiempo en pausa no se simula
+        lat_active = false;         // La pausa no cuenta como latencia
+        break;
+      case KEY_R:         // Retrocede a la instantánea anterior
+        snap_rewind();
         break;
       case KEY_S:         // Siguiente nivel
-        clear(BLACK);
-        enemigo = disparos = pared = 0;
-        playerX = 39, playerY = 22;
-        life = LIFES;
-        if(option == '1'){
-          option = '2';
-          wallOption = 'I';
-          wallStart = 25;
-          goto loop;
-        }
-        else if(option == '2'){
-          option = '3';
-          wallOption = 'I';
-          wallStart = 25;
-          goto loop;
-        }
-        else if(option == '3'){
-          option = '4';
-          wallStart = 30;
-          wallInterval = 22;
-          goto loop;
+        if(option == 'S'){option = 'V'; clear(BLACK); goto stress_report;}
+        if(load_level(option - '0')){
+          option++;
+          reset_level();
+          snap_reset();     // Las instantáneas del nivel anterior no sirven
+          goto play;
         }
-        else{clear(BLACK); option = 'G'; goto start;}
+        clear(BLACK); option = 'G'; goto start;
         break;
     }
-    updated = true;
+    updated = dirty = true;
   }
 
   if(game_over){
@@ -857,74 +2059,92 @@ loop:
     goto gameover;
   }
 
-  // ACTUALIZAR ENEMIGO
-  if(!paused && !game_over && interval(TIMER_ENEMY, speed_e)){
-    enemigo++;
-    move_enemies();
-  }
+  // INICIO DE LA SIMULACIÓN
+  t0 = rdtsc();
+  ticks = enemigo + disparos + pared;
 
-  // ACTUALIZAR BALAS
-  if((option == '1' || option == '3') && !paused &&
-  !game_over && interval(TIMER_BULLET, speed_b)){
-    disparos++;
-    draw_bullet();
-    move_bullets();
-  }
+  // Pasos fijos de SIM_STEP_MS; en pausa el acumulador no se toca
+  steps = paused ? 0 : sim_advance();
+  if(steps) dirty = true;
+  for(; steps && !game_over; steps--){
+    sim_ms += SIM_STEP_MS;
+
+    // ACTUALIZAR ENEMIGO
+    if(interval(TIMER_ENEMY, speed_e)){
+      enemigo++;
+      HOT(HOT_ENEMIES, move_enemies());
+    }
 
-  // ACTUALIZAR PAREDES
-  if(!paused && !game_over && interval(TIMER_WALL, speed_w)){
-    if(pared++ == 2000){
-      clear(BLACK);
-      score += 2000;
-      enemigo = disparos = pared = 0;
-      playerX = 39, playerY = 22;
-      life = LIFES;
+    // ACTUALIZAR BALAS
+    if((level->flags & LEVEL_BULLETS) && interval(TIMER_BULLET, speed_b)){
+      disparos++;
+      if(option == 'S') stress_spawn(playerY - 1, STRESS_BULLETS, CYAN, BLACK, 'o');
+      else draw_bullet();
+      HOT(HOT_BULLETS, move_bullets());
+    }
 
-      if(option == '1'){
-        option = '2';
-        wallOption = 'I';
-        wallStart = 25;
-      }
-      else if(option == '2'){
-        wallOption = 'I';
-        wallStart = 25;
-        option = '3';
+    // ACTUALIZAR PAREDES
+    if(interval(TIMER_WALL, speed_w)){
+      if(pared++ == level->length){
+        if(option == 'S'){
+          clear(BLACK);
+          option = 'V';
+          goto stress_report;
+        }
+        score += 2000;
+        if(!load_level(option - '0')){
+          clear(BLACK);
+          option = 'V';
+          goto won;
+        }
+        option++;
+        reset_level();
+        snap_reset();
+        snap_due = false;
+        break;      // reset_level() vació el acumulador, el nivel empieza de cero
       }
-      else if(option == '3'){
-        option = '4';
-        wallStart = 30;
-        wallInterval = 22;
+      if(level->spawn_every && pared > 22 && pared%level->spawn_every == 0){
+        u32 spawn = rand(level->spawn_range)+wallStart+level->spawn_offset;
+        draw_enemy(spawn);
+        if((level->flags & LEVEL_PAIRS) && spawn+1 < level->spawn_range+wallStart+level->spawn_offset)
+          draw_enemy(spawn+1);
       }
-      else if(option == '4'){
-        option = 'V';
-        goto won;
+      if(option == 'S' && pared > 22){
+        stress_spawn(2, STRESS_ENEMIES, BLUE, GREEN, 'X');
       }
-    };
-    if(option == '1' && pared > 22  && pared%28 == 0){
-      u32 spawn = rand(38)+wallStart+1;
-      draw_enemy(spawn);
-    }
-    if(option == '2' && pared > 22  && pared%40 == 0){
-      u32 spawn = rand(10)+wallStart+15;
-      draw_enemy(spawn);
-    }
-    if(option == '3' && pared > 22  && pared%40 == 0){
-      u32 spawn = rand(10)+wallStart+15;
-      draw_enemy(spawn);
-    }
-    if(option == '4' && pared > 22  && pared%6 == 0){
-      u32 spawn = rand(20)+wallStart+1;
-      draw_enemy(spawn);
-      if(spawn < 20+wallStart) draw_enemy(spawn+1);
-    }
 
-    draw_wall();
-    move_walls();
+      draw_wall();
+      HOT(HOT_WALLS, move_walls());
+      if(pared % SNAP_EVERY == 0) snap_due = true;
+    }
   }
 
-  // ACTUALIZAR EL JUEGO
+  t1 = rdtsc();
+  ticked = enemigo + disparos + pared != ticks;
+
+  // ACTUALIZAR EL JUEGO; sin pasos ni teclas no hay nada que pintar
+  if(!dirty){
+    asm volatile("pause");
+    goto loop;
+  }
   if (updated){
     draw();
   }
+  if(gov_present()){
+    present();
+    lat_presented();
+    dirty = false;
+  }
+
+  if(option == 'S') stress_sample(t0, t1, rdtsc(), ticked);
+#ifdef BENCH
+  bench_tick(t1 - t0, rdtsc() - t1, ticked);
+#endif
+  // Fuera de las ventanas medidas de simulación y pintado
+  if(snap_due){
+    snap_take();
+    snap_due = false;
+  }
+  gov_frame(rdtsc() - tf);
   goto loop;
 }
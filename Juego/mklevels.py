@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""Convierte la descripción de niveles (levels.txt) en el paquete binario que
+lee kmain.c.
+
+Formato (versión 1, little-endian), un sector de 512 bytes por bloque:
+  sector 0      encabezado: "LEAD", u16 versión, u16 número de niveles
+  sector 1 + n  registro del nivel n, con los campos de struct level
+
+Uso: python3 mklevels.py levels.txt levels.bin
+"""
+import configparser
+import struct
+import sys
+
+SECTOR = 512
+VERSION = 1
+MAX_LEVELS = 9
+
+COLORS = ['black', 'blue', 'green', 'cyan', 'red', 'magenta', 'yellow', 'gray']
+FLAGS = ['bullets', 'escape', 'moving', 'pairs']
+
+# Mismo orden que struct level en kmain.c
+HEADER = struct.Struct('<4sHH')
+LEVEL = struct.Struct('<5H11B')
+
+
+def sector(data):
+    if len(data) > SECTOR:
+        sys.exit('registro de %d bytes, no cabe en un sector' % len(data))
+    return data + bytes(SECTOR - len(data))
+
+
+def record(name, lv):
+    flags = 0
+    for bit, flag in enumerate(FLAGS):
+        if lv.getboolean(flag, False):
+            flags |= 1 << bit
+    return LEVEL.pack(
+        lv.getint('length', 2000),
+        lv.getint('spawn_every', 0),
+        lv.getint('enemy_speed'),
+        lv.getint('wall_speed'),
+        lv.getint('bullet_speed', 0),
+        ord(name[0]),
+        COLORS.index(lv.get('color')),
+        lv.getint('wall_start'),
+        lv.getint('wall_len'),
+        lv.getint('wall_min', 0),
+        lv.getint('wall_max', 0),
+        lv.getint('wall_delay', 0),
+        lv.getint('wall_pause', 0),
+        lv.getint('spawn_range', 1),
+        lv.getint('spawn_offset', 0),
+        flags)
+
+
+def main(src, dst):
+    cfg = configparser.ConfigParser()
+    cfg.read(src)
+    names = cfg.sections()
+    if not 0 < len(names) <= MAX_LEVELS:
+        sys.exit('%s: se esperan entre 1 y %d niveles' % (src, MAX_LEVELS))
+    out = sector(HEADER.pack(b'LEAD', VERSION, len(names)))
+    for name in names:
+        out += sector(record(name, cfg[name]))
+    with open(dst, 'wb') as f:
+        f.write(out)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    main(sys.argv[1], sys.argv[2])
@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""Convierte las pantallas fijas de los menús (screens.txt) en plantillas
+comprimidas que blit_template() de kmain.c expande directo en la pantalla.
+
+Cada plantilla recorre las 80x25 celdas en orden con operaciones de un byte,
+los 2 bits altos son el tipo y los 6 bajos un largo n (1 a 63):
+  0  SKIP       salta n celdas sin tocarlas; n = 0 termina la plantilla
+  1  LONG_SKIP  salta n * 64 celdas
+  2  RUN        n celdas iguales, siguen el atributo y el carácter
+  3  TEXT       n celdas con el mismo atributo, siguen el atributo y n caracteres
+
+Uso: python3 mkscreens.py screens.txt screens.h
+"""
+import re
+import sys
+
+COLS, ROWS = 80, 25
+MAX_LEN = 63
+SKIP, LONG_SKIP, RUN, TEXT = range(4)
+
+COLORS = ['black', 'blue', 'green', 'cyan', 'red', 'magenta', 'yellow', 'gray']
+LINE = re.compile(r'^(\d+)\s+(\d+)\s+(\S+)\s+(\S+)\s+"(.*)"$')
+
+
+def color(name):
+    bright = name.startswith('bright-')
+    if bright:
+        name = name[len('bright-'):]
+    if name not in COLORS:
+        sys.exit('color desconocido: %s' % name)
+    return COLORS.index(name) | (8 if bright else 0)
+
+
+def parse(src):
+    screens = {}
+    cells = None
+    with open(src) as f:
+        for n, line in enumerate(f, 1):
+            line = line.rstrip('\n')
+            if not line.strip() or line.lstrip().startswith('#'):
+                continue
+            if line.startswith('['):
+                cells = screens.setdefault(line.strip('[] '), [None] * (COLS * ROWS))
+                continue
+            m = LINE.match(line)
+            if not m or cells is None:
+                sys.exit('%s:%d: se espera x y fg bg "texto"' % (src, n))
+            x, y = int(m.group(1)), int(m.group(2))
+            attr = color(m.group(4)) << 4 | color(m.group(3))
+            for i, c in enumerate(m.group(5)):
+                if x + i >= COLS or y >= ROWS:
+                    sys.exit('%s:%d: el texto se sale de la pantalla' % (src, n))
+                cells[y * COLS + x + i] = (attr, ord(c))
+    return screens
+
+
+def same_run(cells, i):
+    n = 1
+    while i + n < len(cells) and cells[i + n] == cells[i] and n < MAX_LEN:
+        n += 1
+    return n
+
+
+def encode(cells):
+    out = []
+    i = 0
+    last = max((j for j, c in enumerate(cells) if c), default=-1)
+    while i <= last:
+        if cells[i] is None:
+            n = 0
+            while cells[i + n] is None:
+                n += 1
+            i += n
+            if n >= 64:
+                out.append(LONG_SKIP << 6 | n // 64)
+                n %= 64
+            if n:
+                out.append(SKIP << 6 | n)
+            continue
+        n = same_run(cells, i)
+        if n >= 3:
+            out += [RUN << 6 | n, cells[i][0], cells[i][1]]
+            i += n
+            continue
+        attr = cells[i][0]
+        n = 0
+        while (i + n <= last and n < MAX_LEN and cells[i + n] and
+               cells[i + n][0] == attr and same_run(cells, i + n) < 3):
+            n += 1
+        out += [TEXT << 6 | n, attr] + [c[1] for c in cells[i:i + n]]
+        i += n
+    return out + [0]
+
+
+def main(src, dst):
+    lines = ['/* Generado por mkscreens.py desde %s, no editar. */' % src]
+    for name, cells in parse(src).items():
+        data = encode(cells)
+        lines.append('const u8 tpl_%s[%d] = {' % (name, len(data)))
+        for i in range(0, len(data), 12):
+            lines.append('  ' + ', '.join('0x%02X' % b for b in data[i:i + 12]) + ',')
+        lines.append('};')
+    with open(dst, 'w') as f:
+        f.write('\n'.join(lines) + '\n')
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    main(sys.argv[1], sys.argv[2])